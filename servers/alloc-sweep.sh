@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# Compare the allocation strategies of --alloc: run spin-linux or
+# spin-arachne once per strategy and print one CSV row per run. Runs
+# server and client on this machine.
+#
+# Usage: ./alloc-sweep.sh [worker] [work_iterations] [client_threads]
+
+WORKER=${1:-sqrt}
+WORK=${2:-0}
+CLIENTS=${3:-32}
+PORT=${PORT:-5000}
+DURATION=${DURATION:-10}
+SERVER=${SERVER:-linux}
+THREADS=${THREADS:-16}
+GRAPH=${GRAPH:-64:32-256}
+STRATEGIES=${STRATEGIES:-"malloc arena pool"}
+
+echo "server,strategy,graph,requests,secs,rps,p50,p90,p99,p99.9,max"
+for strategy in $STRATEGIES; do
+	if [ $SERVER = arachne ]; then
+		./spin-arachne --alloc $strategy:$GRAPH $WORKER $PORT > /dev/null &
+	else
+		./spin-linux --alloc $strategy:$GRAPH $WORKER $THREADS $PORT > /dev/null &
+	fi
+	server=$!
+	sleep 1
+	printf "%s,%s,%s," $SERVER $strategy $GRAPH
+	./spin-client --csv --threads $CLIENTS --duration $DURATION \
+		--work $WORK 127.0.0.1 $PORT
+	kill $server
+	wait $server 2> /dev/null
+done
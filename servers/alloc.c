@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "common.h"
+#include "stats.h"
+
+#define ALLOC_ALIGN 16
+#define ALLOC_EDGES 2
+#define ARENA_CHUNK (1 << 20)
+#define POOL_MAX_SIZE 4096
+#define POOL_CLASSES (POOL_MAX_SIZE / ALLOC_ALIGN)
+#define POOL_SLAB (64 << 10)
+
+int alloc_strategy = ALLOC_NONE;
+int alloc_nodes = ALLOC_DEFAULT_NODES;
+int alloc_min_size = ALLOC_DEFAULT_MIN;
+int alloc_max_size = ALLOC_DEFAULT_MAX;
+
+static const char *alloc_names[] = {
+	[ALLOC_NONE]	= "none",
+	[ALLOC_MALLOC]	= "malloc",
+	[ALLOC_ARENA]	= "arena",
+	[ALLOC_POOL]	= "pool",
+};
+
+struct alloc_node {
+	struct alloc_node *edges[ALLOC_EDGES];
+	uint32_t size;
+	uint32_t value;
+};
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	unsigned char data[] __attribute__((aligned(ALLOC_ALIGN)));
+};
+
+/* chunks are kept across resets, so a warm arena never calls malloc */
+struct arena {
+	struct arena_chunk *head;
+	struct arena_chunk *cur;
+};
+
+struct pool {
+	void *free_lists[POOL_CLASSES];
+};
+
+static __thread struct arena arena;
+static __thread struct pool pool;
+static __thread struct alloc_node **nodes;
+static __thread unsigned int seed;
+static volatile uint64_t alloc_sink;
+
+static void *xmalloc(size_t size)
+{
+	void *p = malloc(size);
+
+	if (!p) {
+		perror("malloc");
+		exit(1);
+	}
+	return p;
+}
+
+static size_t round_up(size_t size)
+{
+	return (size + ALLOC_ALIGN - 1) & ~(size_t) (ALLOC_ALIGN - 1);
+}
+
+static void *arena_alloc(size_t size)
+{
+	struct arena_chunk *c = arena.cur, *fresh;
+	size_t chunk_size;
+
+	size = round_up(size);
+	while (!c || c->used + size > c->size) {
+		if (c && c->next) {
+			c = c->next;
+			continue;
+		}
+		chunk_size = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+		fresh = xmalloc(sizeof(*fresh) + chunk_size);
+		fresh->next = NULL;
+		fresh->size = chunk_size;
+		fresh->used = 0;
+		if (c)
+			c->next = fresh;
+		else
+			arena.head = fresh;
+		c = fresh;
+	}
+
+	arena.cur = c;
+	c->used += size;
+	return &c->data[c->used - size];
+}
+
+static void arena_reset(void)
+{
+	struct arena_chunk *c;
+
+	for (c = arena.head; c; c = c->next)
+		c->used = 0;
+	arena.cur = arena.head;
+}
+
+static void *pool_alloc(size_t size)
+{
+	int cls = (round_up(size) - 1) / ALLOC_ALIGN;
+	unsigned char *slab;
+	void *p;
+	size_t i;
+
+	if (size > POOL_MAX_SIZE)
+		return xmalloc(size);
+
+	if (!pool.free_lists[cls]) {
+		size = (cls + 1) * ALLOC_ALIGN;
+		slab = xmalloc(POOL_SLAB);
+		for (i = 0; i + size <= POOL_SLAB; i += size) {
+			*(void **) &slab[i] = pool.free_lists[cls];
+			pool.free_lists[cls] = &slab[i];
+		}
+	}
+
+	p = pool.free_lists[cls];
+	pool.free_lists[cls] = *(void **) p;
+	return p;
+}
+
+static void pool_free(void *p, size_t size)
+{
+	int cls = (round_up(size) - 1) / ALLOC_ALIGN;
+
+	if (size > POOL_MAX_SIZE) {
+		free(p);
+		return;
+	}
+	*(void **) p = pool.free_lists[cls];
+	pool.free_lists[cls] = p;
+}
+
+static struct alloc_node *node_alloc(size_t size)
+{
+	switch (alloc_strategy) {
+	case ALLOC_ARENA:
+		return arena_alloc(size);
+	case ALLOC_POOL:
+		return pool_alloc(size);
+	default:
+		return xmalloc(size);
+	}
+}
+
+/* nodes go in creation order, not the LIFO order allocators like best */
+static void graph_free(void)
+{
+	int i;
+
+	switch (alloc_strategy) {
+	case ALLOC_ARENA:
+		arena_reset();
+		break;
+	case ALLOC_POOL:
+		for (i = 0; i < alloc_nodes; i++)
+			pool_free(nodes[i], nodes[i]->size);
+		break;
+	default:
+		for (i = 0; i < alloc_nodes; i++)
+			free(nodes[i]);
+	}
+}
+
+void alloc_work(void)
+{
+	uint64_t start_tsc = rdtsc(), sum = 0;
+	struct alloc_node *n;
+	size_t size;
+	int i, j;
+
+	if (!nodes) {
+		nodes = xmalloc(sizeof(*nodes) * alloc_nodes);
+		seed = rdtsc();
+	}
+
+	for (i = 0; i < alloc_nodes; i++) {
+		size = alloc_min_size +
+		       rand_r(&seed) % (alloc_max_size - alloc_min_size + 1);
+		n = node_alloc(size);
+		n->size = size;
+		n->value = i;
+		for (j = 0; j < ALLOC_EDGES; j++)
+			n->edges[j] = i ? nodes[rand_r(&seed) % i] : NULL;
+		memset(n + 1, i, size - sizeof(*n));
+		nodes[i] = n;
+	}
+
+	for (i = alloc_nodes - 1; i >= 0; i--)
+		for (n = nodes[i]; n; n = n->edges[0])
+			sum += n->value + ((unsigned char *) n)[n->size - 1];
+	alloc_sink = sum;
+
+	graph_free();
+	stat_add(STAT_ALLOCS, alloc_nodes);
+	stat_add(STAT_WORK_CYCLES, rdtsc() - start_tsc);
+}
+
+int alloc_parse(const char *spec)
+{
+	char name[16];
+	int n;
+
+	n = sscanf(spec, "%15[^:]:%d:%d-%d", name, &alloc_nodes,
+		   &alloc_min_size, &alloc_max_size);
+	if (n < 1 || n == 3)
+		return -1;
+
+	for (alloc_strategy = ALLOC_MALLOC; alloc_strategy <= ALLOC_POOL;
+	     alloc_strategy++)
+		if (!strcmp(name, alloc_names[alloc_strategy]))
+			break;
+	if (alloc_strategy > ALLOC_POOL)
+		return -1;
+
+	if (alloc_nodes < 1 || alloc_min_size < (int) sizeof(struct alloc_node) ||
+	    alloc_max_size < alloc_min_size)
+		return -1;
+
+	return 0;
+}
+
+const char *alloc_name(void)
+{
+	return alloc_names[alloc_strategy];
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Allocation-heavy request work. Each request builds a random object
+ * graph of alloc_nodes nodes, each between alloc_min_size and
+ * alloc_max_size bytes with pointers to earlier nodes, walks it and tears
+ * it down again. The allocation strategy is one of:
+ *
+ *  - malloc: the system allocator, freeing every node
+ *  - arena:  a per-thread bump arena, reset when the request ends
+ *  - pool:   per-thread free lists of 16-byte size classes, fed from slabs
+ *
+ * The arena and pools are thread-local, so a request must not yield to
+ * another user thread while it builds its graph; alloc_work() never does.
+ */
+
+enum alloc_strategy {
+	ALLOC_NONE,
+	ALLOC_MALLOC,
+	ALLOC_ARENA,
+	ALLOC_POOL,
+};
+
+#define ALLOC_DEFAULT_NODES 64
+#define ALLOC_DEFAULT_MIN 32
+#define ALLOC_DEFAULT_MAX 256
+
+extern int alloc_strategy;
+extern int alloc_nodes;
+extern int alloc_min_size;
+extern int alloc_max_size;
+
+#if defined (__cplusplus)
+extern "C" {
+#endif
+
+/* STRATEGY[:NODES[:MIN-MAX]]; returns -1 if @spec is invalid */
+int alloc_parse(const char *spec);
+const char *alloc_name(void);
+void alloc_work(void);
+
+#if defined (__cplusplus)
+}
+#endif
@@ -0,0 +1,274 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "common.h"
+#include "stats.h"
+
+#define BACKEND_EVENTS 64
+
+/* both directions; a reply echoes the tag of its call */
+struct backend_msg {
+	uint64_t delay_ns;
+	uint64_t tag;
+};
+
+struct backend_pending {
+	uint64_t due_ns;
+	int fd;
+	uint64_t tag;
+};
+
+static int backend_epfd = -1;
+static int backend_timerfd;
+/* the caller end shared by every backend_call_async() */
+static int async_fd;
+static __thread int sync_fd = -1;
+
+/* calls waiting for their due time, a binary min-heap; backend thread only */
+static struct backend_pending *heap;
+static int heap_n, heap_size;
+
+static void heap_push(struct backend_pending *p)
+{
+	struct backend_pending tmp;
+	int i, parent;
+
+	if (heap_n == heap_size) {
+		heap_size = heap_size ? heap_size * 2 : 1024;
+		heap = realloc(heap, sizeof(*heap) * heap_size);
+		if (!heap) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	i = heap_n++;
+	heap[i] = *p;
+	while (i && heap[parent = (i - 1) / 2].due_ns > heap[i].due_ns) {
+		tmp = heap[parent];
+		heap[parent] = heap[i];
+		heap[i] = tmp;
+		i = parent;
+	}
+}
+
+static void heap_sift_down(int i)
+{
+	struct backend_pending tmp;
+	int child;
+
+	while ((child = 2 * i + 1) < heap_n) {
+		if (child + 1 < heap_n && heap[child + 1].due_ns < heap[child].due_ns)
+			child++;
+		if (heap[i].due_ns <= heap[child].due_ns)
+			break;
+		tmp = heap[child];
+		heap[child] = heap[i];
+		heap[i] = tmp;
+		i = child;
+	}
+}
+
+static void heap_pop(void)
+{
+	heap[0] = heap[--heap_n];
+	heap_sift_down(0);
+}
+
+/* drops the calls that came in over @fd, then restores the heap order */
+static void heap_remove_fd(int fd)
+{
+	int i, n = 0;
+
+	for (i = 0; i < heap_n; i++)
+		if (heap[i].fd != fd)
+			heap[n++] = heap[i];
+	if (n == heap_n)
+		return;
+	heap_n = n;
+	for (i = heap_n / 2 - 1; i >= 0; i--)
+		heap_sift_down(i);
+}
+
+/* any thread: a new socket to the backend, blocking on the caller's side */
+static int backend_connect(void)
+{
+	struct epoll_event ev;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv)) {
+		perror("socketpair");
+		exit(1);
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.fd = sv[1];
+	if (epoll_ctl(backend_epfd, EPOLL_CTL_ADD, sv[1], &ev)) {
+		perror("epoll_ctl: EPOLL_CTL_ADD");
+		exit(1);
+	}
+
+	return sv[0];
+}
+
+static void backend_receive(int fd)
+{
+	struct backend_msg msg;
+	struct backend_pending p;
+	ssize_t ret;
+
+	while ((ret = recv(fd, &msg, sizeof(msg), MSG_DONTWAIT)) == sizeof(msg)) {
+		p.due_ns = now_ns() + msg.delay_ns;
+		p.fd = fd;
+		p.tag = msg.tag;
+		heap_push(&p);
+	}
+
+	/*
+	 * The caller's thread went away. Its calls go too, or a reply could
+	 * reach whatever socket gets this fd number next.
+	 */
+	if (ret == 0 || (ret < 0 && errno != EAGAIN)) {
+		epoll_ctl(backend_epfd, EPOLL_CTL_DEL, fd, NULL);
+		heap_remove_fd(fd);
+		close(fd);
+	}
+}
+
+/* answers every call that is due and sets the timer for the next one */
+static void backend_reply(void)
+{
+	struct backend_msg msg = { 0, 0 };
+	struct itimerspec its;
+	uint64_t now = now_ns();
+
+	while (heap_n && heap[0].due_ns <= now) {
+		msg.tag = heap[0].tag;
+		/* blocks only if a caller stopped reading its replies */
+		if (send(heap[0].fd, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg) &&
+		    errno != EPIPE && errno != ECONNRESET && errno != EBADF)
+			perror("backend: send");
+		heap_pop();
+	}
+
+	/* a due time that has passed meanwhile fires right away */
+	if (!heap_n)
+		return;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = heap[0].due_ns / 1000000000;
+	its.it_value.tv_nsec = heap[0].due_ns % 1000000000;
+	if (timerfd_settime(backend_timerfd, TFD_TIMER_ABSTIME, &its, NULL)) {
+		perror("timerfd_settime");
+		exit(1);
+	}
+}
+
+static void *backend_main(void *arg)
+{
+	struct epoll_event events[BACKEND_EVENTS];
+	uint64_t expirations;
+	int i, nfds;
+
+	while (1) {
+		nfds = epoll_wait(backend_epfd, events, BACKEND_EVENTS, -1);
+		for (i = 0; i < nfds; i++) {
+			if (events[i].data.fd == backend_timerfd) {
+				if (read(backend_timerfd, &expirations,
+					 sizeof(expirations)) < 0 && errno != EAGAIN)
+					perror("backend: read timerfd");
+			} else {
+				backend_receive(events[i].data.fd);
+			}
+		}
+		backend_reply();
+	}
+
+	return NULL;
+}
+
+/* runs the done() callbacks of asynchronous calls */
+static void *backend_reply_main(void *arg)
+{
+	struct backend_msg msg;
+	struct backend_call *call;
+
+	while (1) {
+		if (recv(async_fd, &msg, sizeof(msg), 0) != sizeof(msg)) {
+			perror("backend: recv");
+			exit(1);
+		}
+		call = (struct backend_call *) (uintptr_t) msg.tag;
+		call->done(call);
+	}
+
+	return NULL;
+}
+
+void backend_start(void)
+{
+	struct epoll_event ev;
+	pthread_t tid;
+
+	backend_epfd = epoll_create1(0);
+	if (backend_epfd < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+
+	backend_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (backend_timerfd < 0) {
+		perror("timerfd_create");
+		exit(1);
+	}
+	ev.events = EPOLLIN;
+	ev.data.fd = backend_timerfd;
+	if (epoll_ctl(backend_epfd, EPOLL_CTL_ADD, backend_timerfd, &ev)) {
+		perror("epoll_ctl: EPOLL_CTL_ADD");
+		exit(1);
+	}
+
+	async_fd = backend_connect();
+
+	if (pthread_create(&tid, NULL, backend_main, NULL) ||
+	    pthread_create(&tid, NULL, backend_reply_main, NULL)) {
+		fprintf(stderr, "failed to spawn backend threads\n");
+		exit(-1);
+	}
+}
+
+void backend_call(uint64_t delay_ns)
+{
+	struct backend_msg msg = { delay_ns, 0 };
+
+	if (sync_fd < 0)
+		sync_fd = backend_connect();
+
+	stat_add(STAT_SYSCALLS, 2);
+	if (send(sync_fd, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg) ||
+	    recv(sync_fd, &msg, sizeof(msg), 0) != sizeof(msg)) {
+		perror("backend_call");
+		exit(1);
+	}
+}
+
+/* SOCK_SEQPACKET keeps concurrent callers' messages whole */
+void backend_call_async(struct backend_call *call, uint64_t delay_ns)
+{
+	struct backend_msg msg = { delay_ns, (uint64_t) (uintptr_t) call };
+
+	stat_inc(STAT_SYSCALLS);
+	if (send(async_fd, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg)) {
+		perror("backend_call_async");
+		exit(1);
+	}
+}
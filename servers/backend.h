@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * A local mock backend for blocking requests: one thread that answers
+ * each call once the delay the call asks for has passed, like a remote
+ * service would. Calls and replies travel over AF_UNIX SOCK_SEQPACKET
+ * socketpairs, so the server under test really blocks in the kernel or
+ * waits for a completion, and many calls can be in flight at once.
+ */
+
+/* an asynchronous call; done() runs on the backend's reply thread */
+struct backend_call {
+	void (*done)(struct backend_call *call);
+};
+
+#if defined (__cplusplus)
+extern "C" {
+#endif
+
+void backend_start(void);
+/* blocks the calling kernel thread for @delay_ns, plus the round trip */
+void backend_call(uint64_t delay_ns);
+void backend_call_async(struct backend_call *call, uint64_t delay_ns);
+
+#if defined (__cplusplus)
+}
+#endif
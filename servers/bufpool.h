@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Free list of fixed-size receive buffers, carved out of larger chunks
+ * that are never given back to malloc. A pool is not thread-safe: keep one
+ * per thread, or lock around it.
+ */
+
+#define BUF_POOL_CHUNK 64
+
+struct buf_pool {
+	size_t size;
+	void *free_list;
+};
+
+static inline unsigned char *buf_pool_get(struct buf_pool *pool)
+{
+	unsigned char *chunk;
+	void *buf;
+	int i;
+
+	if (!pool->free_list) {
+		chunk = (unsigned char *) malloc(pool->size * BUF_POOL_CHUNK);
+		if (!chunk) {
+			perror("malloc");
+			exit(1);
+		}
+		for (i = 0; i < BUF_POOL_CHUNK; i++) {
+			*(void **) &chunk[i * pool->size] = pool->free_list;
+			pool->free_list = &chunk[i * pool->size];
+		}
+	}
+
+	buf = pool->free_list;
+	pool->free_list = *(void **) buf;
+	return (unsigned char *) buf;
+}
+
+static inline void buf_pool_put(struct buf_pool *pool, unsigned char *buf)
+{
+	*(void **) buf = pool->free_list;
+	pool->free_list = buf;
+}
@@ -15,31 +15,243 @@
 
 #include "Arachne/Arachne.h"
 #include "Arachne/DefaultCorePolicy.h"
+#include "alloc.h"
+#include "backend.h"
+#include "bufpool.h"
 #include "common.h"
+#include "core-policy.h"
 #include "memcached.h"
+#include "proto.h"
+#include "request.h"
+#include "shm-ring.h"
+#include "stats.h"
 
 #define BUFSIZE 2048
-#define CONFIG_MAX_EVENTS 1
+#define CONFIG_MAX_EVENTS 64
+#define MAX_DISPATCHERS 64
+#define MAX_UDP_BATCH 64
+#define PENDING_LIMIT 1024
+#define CONN_CHUNK 256
 #define BACKLOG 8192
-
-struct payload {
-	uint64_t work_iterations;
-	uint64_t index;
-};
+#define UDP_IDLE_MS 1000
 
 struct conn {
 	int fd;
 	int buf_head;
 	int buf_tail;
-	unsigned char buf[BUFSIZE];
+	unsigned char *buf;
+
+	/* recv_tsc is preset when the dispatcher notices the conn */
+	struct req_state req;
 
 	/* similar to Arachne memcache, this indicates if a connection is
 	   already being handled by an existing thread, or if it is done. */
 	bool finished;
+
+	/* persistent mode: the conn's own thread waits here */
+	bool persistent;
+	Arachne::Semaphore ready;
+
+	/* see conn_alloc() */
+	int refs;
+	volatile bool closing;
+	struct conn *next_free;
+
+	/* connected UDP sockets only; see udp_reclaim_idle() */
+	bool idle;
+	struct conn *next_udp;
 };
 
-static int epollfd;
+/* a shared-memory channel, handed to one Arachne thread at a time */
+struct shm_conn {
+	struct shm_channel *ch;
+	uint64_t ready_tsc;
+	volatile bool finished;
+};
+
+/*
+ * Batched UDP: up to udp_batch datagrams from one recvmmsg(), served by a
+ * single Arachne thread and answered with one sendmmsg().
+ */
+struct udp_batch {
+	int sock;
+	int n;
+	uint64_t recv_tsc;
+	struct udp_batch *next;
+	struct mmsghdr msgs[MAX_UDP_BATCH];
+	struct iovec iovs[MAX_UDP_BATCH];
+	struct sockaddr_in addrs[MAX_UDP_BATCH];
+	struct payload reqs[MAX_UDP_BATCH];
+	struct payload_ts replies[MAX_UDP_BATCH];
+};
+
+/*
+ * TCP dispatchers each have their own listener and epoll set. Work that
+ * finds no free Arachne thread context waits in a bounded FIFO until
+ * threads free up.
+ */
+struct dispatcher {
+	volatile uint64_t busy_tsc;
+	volatile uint64_t events;
+	void **pending;
+	uint64_t pending_head;
+	volatile uint64_t pending_tail;
+	/* OVERFLOW_STOP: posted by finishing workers while we are stalled */
+	Arachne::Semaphore room;
+	volatile bool stalled;
+} __attribute__((aligned(64)));
+
+/* starts a thread for one pending item, false if Arachne has none left */
+typedef bool (*spawn_fn)(void *item);
+
+static int epollfd;	/* UDP only */
+int nr_dispatchers = 1;
+int persistent_threads;
+int udp_batch;
+int pending_limit = PENDING_LIMIT;
+uint64_t inline_threshold;
+int inline_auto;
+int overflow_policy = OVERFLOW_STOP;
+int admission_stats;
+static struct dispatcher dispatchers[MAX_DISPATCHERS];
+/* threads started through the pending queue's spawn functions */
+static volatile int nr_workers;
+static volatile int nr_stalled;
 struct sockaddr_in udp_sin;
+const char *shm_name;
+int shm_channels;
+uint64_t split_threshold;
+int split_ways = 1;
+int lazy_buffers;
+int block_mode;
+int cpu_stats;
+
+/*
+ * Receive buffers. Arachne threads hop between cores, so there is one
+ * shared pool. With lazy_buffers a conn only holds a buffer while one of
+ * its threads runs or a partial request is pending.
+ */
+static struct buf_pool buf_pool = { BUFSIZE };
+static Arachne::SpinLock buf_pool_lock;
+
+static unsigned char *buf_attach(void)
+{
+	unsigned char *buf;
+
+	buf_pool_lock.lock();
+	buf = buf_pool_get(&buf_pool);
+	buf_pool_lock.unlock();
+	stat_inc(STAT_BUF_ATTACHES);
+
+	return buf;
+}
+
+static void buf_release(struct conn *conn)
+{
+	buf_pool_lock.lock();
+	buf_pool_put(&buf_pool, conn->buf);
+	buf_pool_lock.unlock();
+	stat_inc(STAT_BUF_RELEASES);
+
+	conn->buf = NULL;
+	conn->buf_head = 0;
+	conn->buf_tail = 0;
+}
+
+/*
+ * Conns are recycled through a pool. Each one is reference counted: the
+ * dispatcher holds a reference while the fd is in its epoll set, and so
+ * does every thread or pending-queue entry the conn is handed to. Only the
+ * last put closes the fd, so its number cannot be reused by a new conn
+ * while an old worker still holds it.
+ */
+static struct conn *free_conns;
+static Arachne::SpinLock conn_pool_lock;
+
+/* with conn_pool_lock held, or before the dispatchers start */
+static void conn_pool_grow(void)
+{
+	struct conn *chunk = new struct conn[CONN_CHUNK];
+	int i;
+
+	for (i = 0; i < CONN_CHUNK; i++) {
+		chunk[i].next_free = free_conns;
+		free_conns = &chunk[i];
+	}
+}
+
+/* returns a conn for @fd holding the dispatcher's reference */
+static struct conn *conn_alloc(int fd)
+{
+	struct conn *conn;
+
+	conn_pool_lock.lock();
+	if (!free_conns)
+		conn_pool_grow();
+	conn = free_conns;
+	free_conns = conn->next_free;
+	conn_pool_lock.unlock();
+
+	conn->fd = fd;
+	conn->buf_head = 0;
+	conn->buf_tail = 0;
+	conn->buf = NULL;
+	req_init(&conn->req);
+	conn->finished = true;
+	conn->persistent = false;
+	conn->ready.reset();
+	conn->refs = 1;
+	conn->closing = false;
+	conn->idle = false;
+
+	return conn;
+}
+
+static void conn_hold(struct conn *conn)
+{
+	__sync_fetch_and_add(&conn->refs, 1);
+}
+
+static void conn_put(struct conn *conn)
+{
+	if (__sync_sub_and_fetch(&conn->refs, 1))
+		return;
+
+	stat_inc(STAT_SYSCALLS);
+	close(conn->fd);
+	if (conn->buf)
+		buf_release(conn);
+	stat_inc(STAT_CLOSES);
+
+	conn_pool_lock.lock();
+	conn->next_free = free_conns;
+	free_conns = conn;
+	conn_pool_lock.unlock();
+}
+
+/*
+ * Any thread: the conn is done. shutdown() keeps the fd allocated but
+ * raises EPOLLHUP, which makes the dispatcher unregister the conn.
+ */
+static void conn_shutdown(struct conn *conn)
+{
+	conn->closing = true;
+	stat_inc(STAT_SYSCALLS);
+	shutdown(conn->fd, SHUT_RDWR);
+}
+
+/* dispatcher only: stop watching the conn and drop its reference */
+static void conn_unregister(struct conn *conn, int epfd)
+{
+	conn->closing = true;
+	stat_inc(STAT_SYSCALLS);
+	epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	/* a persistent thread wakes up, sees closing and exits */
+	if (conn->persistent)
+		conn->ready.notify();
+	conn_put(conn);
+}
+static struct shm_region *shm_region;
 
 /* return 1 if we should yield and try again later, 0 otherwise */
 static int should_yield(ssize_t ret)
@@ -54,110 +266,360 @@ static int avail_bytes(struct conn *conn)
 	return conn->buf_tail - conn->buf_head;
 }
 
-static int recv_exactly(struct conn *conn, void *buf, size_t size)
+static ssize_t tcp_recv(void *arg, void *buf, size_t len)
 {
+	struct conn *conn = (struct conn *) arg;
+
+	return req_buf_recv(conn->fd, conn->buf, BUFSIZE, &conn->buf_head,
+			    &conn->buf_tail, buf, len);
+}
+
+/* a full socket buffer only blocks this thread, never the reply */
+static ssize_t tcp_send(void *arg, const void *buf, size_t len)
+{
+	struct conn *conn = (struct conn *) arg;
 	ssize_t ret;
-	if (avail_bytes(conn) < (int) size) {
-		if (conn->buf_head) {
-			memmove(conn->buf, &conn->buf[conn->buf_head], avail_bytes(conn));
-			conn->buf_tail -= conn->buf_head;
-			conn->buf_head = 0;
-		}
-		while (conn->buf_tail < (int) size) {
-			assert(BUFSIZE - conn->buf_tail > 0);
-			ret = recv(conn->fd, &conn->buf[conn->buf_tail], BUFSIZE - conn->buf_tail, 0);
-			if (should_yield(ret))
-				return -1;
-			else if (ret <= 0)
-				return ret;
-			conn->buf_tail += ret;
-		}
+
+	while (1) {
+		stat_inc(STAT_SYSCALLS);
+		ret = send(conn->fd, buf, len, MSG_NOSIGNAL);
+		if (!should_yield(ret))
+			return ret < 0 ? -errno : ret;
+		Arachne::yield();
 	}
-	memcpy(buf, &conn->buf[conn->buf_head], size);
-	conn->buf_head += size;
+}
 
-	return 1;
+/*
+ * Inline fast path: dispatchers serve requests shorter than the threshold
+ * themselves instead of paying for a thread. With inline_auto the
+ * threshold is the cost of a spawn over the cost of one iteration, both
+ * moving averages measured online; racing updates only blur them.
+ */
+static double spawn_cycles, iter_cycles;
+
+static bool inline_enabled(void)
+{
+	return inline_auto || inline_threshold;
 }
 
-static int send_exactly(struct conn *conn, void *buf, size_t size)
+static bool inline_ok(const struct payload *p)
 {
-	ssize_t ret;
-	char *cbuf = (char *) buf;
-	size_t bytes_sent = 0;
+	uint64_t iterations = proto_iterations(p);
 
-	while (bytes_sent < size) {
-		ret = send(conn->fd, &cbuf[bytes_sent], size - bytes_sent, MSG_NOSIGNAL);
-		if (should_yield(ret))
-			Arachne::yield();
-		else if (ret <= 0)
-			return ret;
-		else
-			bytes_sent += ret;
+	/* a dispatcher must never block */
+	if (proto_flags(p) & PROTO_FLAG_BLOCKING)
+		return false;
+	if (!inline_auto)
+		return iterations < inline_threshold;
+	/* until both costs are known, only inline requests with no work */
+	if (!spawn_cycles)
+		return false;
+	return !iterations || (iter_cycles && iterations * iter_cycles < spawn_cycles);
+}
+
+static void ewma(double *avg, double sample)
+{
+	*avg = *avg ? *avg + (sample - *avg) / 16 : sample;
+}
+
+static void spawn_learn(uint64_t start_tsc)
+{
+	__sync_fetch_and_add(&nr_workers, 1);
+	stat_inc(STAT_SPAWNS);
+	if (inline_auto)
+		ewma(&spawn_cycles, rdtsc() - start_tsc);
+}
+
+static void work_part(uint64_t iterations)
+{
+	uint64_t start_tsc = rdtsc(), cycles;
+
+	do_work(iterations);
+	cycles = rdtsc() - start_tsc;
+	stat_add(STAT_WORK_CYCLES, cycles);
+	if (inline_auto && iterations)
+		ewma(&iter_cycles, (double) cycles / iterations);
+}
+
+/*
+ * Long requests fork split_ways - 1 Arachne threads, run the first part
+ * here and join the rest. If no thread can be created, the part runs
+ * inline.
+ */
+static void run_work(uint64_t iterations)
+{
+	Arachne::ThreadId parts[MAX_SPLIT_WAYS];
+	uint64_t each;
+	int i;
+
+	if (split_ways <= 1 || iterations < split_threshold) {
+		work_part(iterations);
+		return;
+	}
+
+	each = iterations / split_ways;
+	for (i = 1; i < split_ways; i++) {
+		parts[i] = Arachne::createThread(work_part, each);
+		if (parts[i] == Arachne::NullThread)
+			work_part(each);
 	}
+	work_part(iterations - each * (split_ways - 1));
+	/* NullThread marks a part that already ran inline */
+	for (i = 1; i < split_ways; i++)
+		if (parts[i] != Arachne::NullThread)
+			Arachne::join(parts[i]);
+	stat_inc(STAT_SPLITS);
+}
+
+/* a blocked Arachne thread gives its core to the other threads */
+struct blocked_call {
+	struct backend_call call;
+	Arachne::Semaphore done;
+};
 
-	return 1;
+static void blocked_call_done(struct backend_call *call)
+{
+	((struct blocked_call *) call)->done.notify();
 }
 
-static int handle_ret(struct conn *conn, ssize_t ret, int line)
+static void block(uint64_t ns)
 {
-	if (ret == 0) {
-		close(conn->fd);
-		/* TODO: should also free conn */
-		return 1;
-	} else if (ret == -1) {
-		switch (errno) {
-		case EBADF:
-			return 1;
-		case EPIPE:
-		case ECONNRESET:
-			close(conn->fd);
-			/* TODO: should also free conn */
-			return 1;
-		default:
-			fprintf(stderr, "Unexpected errno %d at line %d\n", errno, line);
-		}
+	struct blocked_call b;
+
+	stat_inc(STAT_BLOCKS);
+	if (block_mode == BLOCK_SLEEP) {
+		Arachne::sleep(ns);
+		return;
 	}
+	b.call.done = blocked_call_done;
+	backend_call_async(&b.call, ns);
+	b.done.wait();
+}
 
-	assert(ret == 1);
+static void run_request(const struct payload *p)
+{
+	uint64_t iterations = proto_iterations(p);
 
-	return 0;
+	if (alloc_strategy != ALLOC_NONE)
+		alloc_work();
+	if (!(proto_flags(p) & PROTO_FLAG_BLOCKING)) {
+		run_work(iterations);
+		return;
+	}
+
+	run_work(iterations / 2);
+	block(proto_block_us(p) * 1000ull);
+	run_work(iterations - iterations / 2);
+}
+
+static void tcp_work(void *arg, struct req_state *st)
+{
+	core_policy_record(st->start_tsc - st->recv_tsc);
+	run_request(&st->payload);
 }
 
-uint64_t ntohll(uint64_t value)
+static void inline_work(void *arg, struct req_state *st)
 {
-	/* really lazy, assumes a specific endianness */
+	tcp_work(arg, st);
+	stat_inc(STAT_INLINE);
+}
 
-	const uint32_t high_part = ntohl((uint32_t) (value >> 32));
-	const uint32_t low_part = ntohl((uint32_t) (value & 0xFFFFFFFFLL));
+static bool inline_admit(void *arg, struct req_state *st)
+{
+	return inline_ok(&st->payload);
+}
+
+static void reject_work(void *arg, struct req_state *st)
+{
+	proto_set_flags(&st->payload, PROTO_FLAG_REJECTED);
+}
+
+/* threads, the dispatcher's inline fast path and the overload path */
+static const struct transport tcp_transport = {
+	tcp_recv, tcp_send, tcp_work, NULL, NULL,
+};
+static const struct transport inline_transport = {
+	tcp_recv, tcp_send, inline_work, NULL, inline_admit,
+};
+static const struct transport reject_transport = {
+	tcp_recv, tcp_send, reject_work, NULL, NULL,
+};
+
+/* serves requests until the socket runs dry, the conn closes or @t defers */
+static always_inline enum req_status serve(struct conn *conn,
+					   const struct transport *t)
+{
+	enum req_status status;
+
+	if (!conn->buf)
+		conn->buf = buf_attach();
+	status = req_drive(&conn->req, conn, t);
+	if (status == REQ_CLOSED)
+		conn_shutdown(conn);
+	if (lazy_buffers && !avail_bytes(conn))
+		buf_release(conn);
+
+	return status;
+}
+
+/* returns false once the conn has been closed */
+static bool serve_conn(struct conn *conn)
+{
+	return serve(conn, &tcp_transport) != REQ_CLOSED;
+}
+
+/*
+ * Runs on the dispatcher: serves buffered requests while they are short.
+ * Returns true if a long request is left in conn->req for a thread.
+ */
+static bool serve_inline(struct conn *conn)
+{
+	return serve(conn, &inline_transport) == REQ_DEFERRED;
+}
+
+/* the last thing a worker does: wake the dispatchers that wait for room */
+static void worker_done(void)
+{
+	int i;
 
-	return (((uint64_t) low_part) << 32) | high_part;
+	__sync_fetch_and_sub(&nr_workers, 1);
+	if (!nr_stalled)
+		return;
+	for (i = 0; i < nr_dispatchers; i++)
+		if (dispatchers[i].stalled)
+			dispatchers[i].room.notify();
 }
 
+/* a fresh thread for every burst of readiness */
 static void tcp_worker(struct conn *conn)
 {
-	ssize_t ret = 0;
-	uint64_t iterations;
-	struct payload payload;
+	serve_conn(conn);
+	conn->finished = true;
+	conn_put(conn);
+	worker_done();
+}
 
-next_request:
-	ret = recv_exactly(conn, &payload, sizeof(payload));
-	if (should_yield(ret) || handle_ret(conn, ret, __LINE__)) {
-		conn->finished = true;
+static bool spawn_tcp(void *item)
+{
+	uint64_t start_tsc = rdtsc();
+
+	if (Arachne::createThread(tcp_worker, (struct conn *) item) ==
+	    Arachne::NullThread)
+		return false;
+	spawn_learn(start_tsc);
+	return true;
+}
+
+/*
+ * Overload: the dispatcher answers every buffered request itself with
+ * PROTO_FLAG_REJECTED instead of doing the work, or drops the conn.
+ */
+static void overflow_tcp(struct conn *conn, int epfd)
+{
+	if (overflow_policy == OVERFLOW_DROP) {
+		stat_inc(STAT_DROPS);
+		conn_unregister(conn, epfd);
+		conn_put(conn);
 		return;
 	}
 
-	iterations = ntohll(payload.work_iterations);
-	do_work(iterations);
+	serve(conn, &reject_transport);
+	conn->finished = true;
+	conn_put(conn);
+}
+
+static bool pending_empty(struct dispatcher *d)
+{
+	return d->pending_head == d->pending_tail;
+}
 
-	ret = send_exactly(conn, &payload, sizeof(payload));
-	if (handle_ret(conn, ret, __LINE__)) {
+static bool pending_push(struct dispatcher *d, void *item)
+{
+	if (d->pending_tail - d->pending_head >= (uint64_t) pending_limit)
+		return false;
+	d->pending[d->pending_tail % pending_limit] = item;
+	d->pending_tail++;
+	stat_inc(STAT_QUEUED);
+	return true;
+}
+
+/* hands queued work to threads, oldest first, until Arachne runs out */
+static void pending_drain(struct dispatcher *d, spawn_fn spawn)
+{
+	while (!pending_empty(d) &&
+	       spawn(d->pending[d->pending_head % pending_limit]))
+		d->pending_head++;
+}
+
+/*
+ * Starts a thread for item, or queues it behind earlier work. Returns
+ * false if the queue is full and the caller must apply the overflow
+ * policy; OVERFLOW_STOP instead stops reading until there is room.
+ */
+static bool admit(struct dispatcher *d, spawn_fn spawn, void *item)
+{
+	pending_drain(d, spawn);
+	if (pending_empty(d) && spawn(item))
+		return true;
+	if (pending_push(d, item))
+		return true;
+	if (overflow_policy != OVERFLOW_STOP)
+		return false;
+
+	/*
+	 * Sleep until a worker finishes rather than spin on the core. Stalled
+	 * is set before the retry, so a worker that finishes meanwhile posts.
+	 * With --queue 0 nothing is ever pushed, so retry the spawn too.
+	 */
+	stat_inc(STAT_STALLS);
+	d->stalled = true;
+	__sync_fetch_and_add(&nr_stalled, 1);
+	while (1) {
+		pending_drain(d, spawn);
+		if ((pending_empty(d) && spawn(item)) || pending_push(d, item))
+			break;
+		/* with no workers left, the last ones are freeing their contexts */
+		if (nr_workers > 0)
+			d->room.wait();
+		else
+			Arachne::yield();
+	}
+	__sync_fetch_and_sub(&nr_stalled, 1);
+	d->stalled = false;
+	d->room.reset();
+
+	return true;
+}
+
+static void pending_init(struct dispatcher *d)
+{
+	d->pending = (void **) calloc(pending_limit ? pending_limit : 1,
+				      sizeof(*d->pending));
+	if (!d->pending) {
+		perror("calloc");
+		exit(1);
+	}
+}
+
+/*
+ * Persistent mode: each conn keeps one thread for its whole life, which
+ * sleeps on the conn's semaphore until the dispatcher sees data.
+ */
+static void tcp_conn_thread(struct conn *conn)
+{
+	bool open = true;
+
+	while (open) {
+		conn->ready.wait();
+		if (conn->closing)
+			break;
+		open = serve_conn(conn);
 		conn->finished = true;
-		return;
 	}
-	goto next_request;
+	conn_put(conn);
 }
 
-static void epoll_ctl_add(int fd, void *arg)
+static void epoll_ctl_add(int epfd, int fd, void *arg)
 {
 	struct epoll_event ev;
 
@@ -165,7 +627,8 @@ static void epoll_ctl_add(int fd, void *arg)
 	ev.data.fd = fd;
 	ev.data.ptr = arg;
 
-	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+	stat_inc(STAT_SYSCALLS);
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
 		perror("epoll_ctl: EPOLL_CTL_ADD");
 		exit(EXIT_FAILURE);
 	}
@@ -199,20 +662,27 @@ static void setreuse(int sock)
 
 }
 
-static void dispatcher_tcp(int port)
+/*
+ * One of nr_dispatchers TCP dispatchers. SO_REUSEPORT shards incoming
+ * connections over their listeners, and each conn stays in the epoll set
+ * of the dispatcher that accepted it.
+ */
+static void dispatcher_tcp(int port, int id)
 {
+	struct dispatcher *d = &dispatchers[id];
 	struct sockaddr_in sin;
 	int sock, one;
-	int ret, i, nfds, conn_sock;
+	int ret, i, nfds, conn_sock, epfd;
 	struct epoll_event ev, events[CONFIG_MAX_EVENTS];
 	struct conn *conn;
+	uint64_t start_tsc;
 
 	sock = socket(AF_INET, SOCK_STREAM, 0);
 	if (!sock) {
 		perror("socket");
 		exit(1);
 	}
-	printf("dispatcher_tcp\n");
+	printf("dispatcher_tcp %d\n", id);
 	fflush(stdout);
 	setnonblocking(sock);
 	setreuse(sock);
@@ -232,58 +702,125 @@ static void dispatcher_tcp(int port)
 		exit(1);
 	}
 
-	epollfd = epoll_create1(0);
+	epfd = epoll_create1(0);
 	ev.events = EPOLLIN;
 	ev.data.u32 = 0;
-	ret = epoll_ctl(epollfd, EPOLL_CTL_ADD, sock, &ev);
+	ret = epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev);
 	assert(!ret);
+	pending_init(d);
 
 	while (1) {
-		nfds = epoll_wait(epollfd, events, CONFIG_MAX_EVENTS, -1);
-		assert(nfds > 0);
+		/* only block while nothing is waiting for a thread */
+		pending_drain(d, spawn_tcp);
+		if (!pending_empty(d))
+			Arachne::yield();
+		stat_inc(STAT_SYSCALLS);
+		nfds = epoll_wait(epfd, events, CONFIG_MAX_EVENTS,
+				  pending_empty(d) ? -1 : 0);
+		if (nfds <= 0)
+			continue;
+		start_tsc = rdtsc();
 		for (i = 0; i < nfds; i++) {
 			if (events[i].data.u32 == 0) {
+				stat_add(STAT_SYSCALLS, 4);	/* accept, 2x fcntl, setsockopt */
 				conn_sock = accept(sock, NULL, NULL);
 				if (conn_sock == -1) {
+					/* the client may have given up already */
+					if (errno == EAGAIN || errno == ECONNABORTED)
+						continue;
 					perror("accept");
 					exit(EXIT_FAILURE);
 				}
 				setnonblocking(conn_sock);
+				one = 1;
 				if (setsockopt(conn_sock, IPPROTO_TCP, TCP_NODELAY, (void *) &one, sizeof(one))) {
 					perror("setsockopt(TCP_NODELAY)");
 					exit(1);
 				}
-				conn = (struct conn*) malloc(sizeof *conn);
-
-				conn->fd = conn_sock;
-				conn->buf_head = 0;
-				conn->buf_tail = 0;
-				conn->finished = true;
-				epoll_ctl_add(conn_sock, conn);
+				conn = conn_alloc(conn_sock);
+				if (!lazy_buffers)
+					conn->buf = buf_attach();
+				/* without a thread of its own, fall back to one per burst */
+				if (persistent_threads) {
+					conn_hold(conn);
+					conn->persistent = Arachne::createThread(tcp_conn_thread, conn) !=
+						Arachne::NullThread;
+					if (!conn->persistent)
+						conn_put(conn);
+				}
+				stat_inc(STAT_ACCEPTS);
+				epoll_ctl_add(epfd, conn_sock, conn);
 			} else {
 				conn = (struct conn*) events[i].data.ptr;
-				if (events[i].events & (EPOLLHUP | EPOLLERR)) {
-					close(conn->fd);
-					/* TODO: should also free conn */
+				if ((events[i].events & (EPOLLHUP | EPOLLERR)) ||
+				    conn->closing) {
+					conn_unregister(conn, epfd);
 				} else if (!conn->finished) {
 					/* conn is already being handled by another Arachne thread */
 					continue;
 				} else {
 					conn->finished = false;
-					if (Arachne::createThread(tcp_worker, conn) ==
-					       Arachne::NullThread) {
-					  conn->finished = true; /* try again later */
-					  //printf("Arachne createThread failed!\n");
+					/* a request deferred by serve_inline() keeps its stamp */
+					if (!conn->req.recv_tsc)
+						conn->req.recv_tsc = rdtsc();
+					if (inline_enabled() && !serve_inline(conn)) {
+						conn->finished = true;
+					} else if (conn->persistent) {
+						conn->ready.notify();
+						stat_inc(STAT_WAKEUPS);
+					} else {
+						/* for the thread or pending entry */
+						conn_hold(conn);
+						if (!admit(d, spawn_tcp, conn))
+							overflow_tcp(conn, epfd);
 					}
 				}
 			}
 		}
+		d->busy_tsc += rdtsc() - start_tsc;
+		d->events += nfds;
 	}
 }
 
-static void udp_worker(struct conn *conn, int sock)
+/* time spent handling events, which bounds what each dispatcher can take */
+static void dispatcher_report(double secs)
+{
+	static uint64_t last_busy[MAX_DISPATCHERS], last_events[MAX_DISPATCHERS];
+	uint64_t busy, events;
+	int i;
+
+	printf("dispatchers: busy%%");
+	for (i = 0; i < nr_dispatchers; i++) {
+		busy = dispatchers[i].busy_tsc;
+		printf(" %.0f", 100 * (busy - last_busy[i]) / cycles_per_ns / (secs * 1e9));
+		last_busy[i] = busy;
+	}
+	printf(" events/s");
+	for (i = 0; i < nr_dispatchers; i++) {
+		events = dispatchers[i].events;
+		printf(" %.0f", (events - last_events[i]) / secs);
+		last_events[i] = events;
+	}
+	printf(" pending");
+	for (i = 0; i < nr_dispatchers; i++)
+		printf(" %lu", dispatchers[i].pending_tail - dispatchers[i].pending_head);
+	printf("\n");
+	if (inline_auto)
+		printf("inline: spawn %.0f cycles, %.1f cycles/iteration, threshold %.0f iterations\n",
+		       spawn_cycles, iter_cycles,
+		       iter_cycles ? spawn_cycles / iter_cycles : 0);
+}
+
+/* connected UDP sockets, pushed by workers */
+static struct conn *udp_conns;
+static Arachne::SpinLock udp_conns_lock;
+
+static void udp_serve(struct conn *conn, int sock)
 {
 	struct payload p;
+	struct payload_ts reply;
+	uint64_t recv_tsc, start_tsc, end_tsc;
+	void *msg = &p;
 	struct sockaddr_in caddr;
 	socklen_t caddr_len = sizeof(caddr);
 	int conn_sock;
@@ -291,27 +828,34 @@ static void udp_worker(struct conn *conn, int sock)
 	if (conn)
 		sock = conn->fd;
 
+	stat_inc(STAT_SYSCALLS);
 	ssize_t ret = recvfrom(sock, &p, sizeof(p), 0, (struct sockaddr *)&caddr, &caddr_len);
 	if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-		if (conn)
-	  		conn->finished = true;
 		return; /* nothing to read */
 	} else if (ret != sizeof(p)) {
 		printf("udp_worker: error, received wrong size payload %ld, expected %lu for sock %d\n", ret, sizeof(p), sock);
-		if (conn)
-			conn->finished = true;
 		return;
 	}
 
 	/* perform fake work */
-	uint64_t iterations = ntohll(p.work_iterations);
-	do_work(iterations);
+	recv_tsc = start_tsc = rdtsc();
+	run_request(&p);
+	end_tsc = rdtsc();
 
 	/* send a response */
 	ssize_t len = sizeof(p);
-	ret = sendto(sock, &p, len, 0, (struct sockaddr *)&caddr, sizeof(caddr));
+	if (proto_flags(&p) & PROTO_FLAG_TIMESTAMPS) {
+		payload_ts_fill(&reply, &p, tsc_to_ns(recv_tsc), tsc_to_ns(start_tsc),
+				tsc_to_ns(end_tsc), tsc_to_ns(rdtsc()));
+		msg = &reply;
+		len = sizeof(reply);
+	}
+	stat_inc(STAT_SYSCALLS);
+	ret = sendto(sock, msg, len, 0, (struct sockaddr *)&caddr, sizeof(caddr));
 	if (ret != len)
 		printf("udp_worker: udp write failed, ret = %ld\n", ret);
+	else
+		stat_inc(STAT_REQUESTS);
 	
 	if (!conn) {
 		/* setup a new socket for this client addr/port */
@@ -333,20 +877,134 @@ static void udp_worker(struct conn *conn, int sock)
 		}
 
 		/* add this socket to epoll */
-		conn = (struct conn *)  malloc(sizeof(struct conn));
-		conn->fd = conn_sock;
-		epoll_ctl_add(conn_sock, (void *) conn);
+		conn = conn_alloc(conn_sock);
+		udp_conns_lock.lock();
+		conn->next_udp = udp_conns;
+		udp_conns = conn;
+		udp_conns_lock.unlock();
+		epoll_ctl_add(epollfd, conn_sock, (void *) conn);
 	}
+}
 
-	conn->finished = true;
+/*
+ * Dispatcher only. A connected UDP socket never sees EPOLLHUP, so every
+ * UDP_IDLE_MS close those that got no datagram since the last pass.
+ * A returning client lands on the shared socket and gets a new one.
+ */
+static void udp_reclaim_idle(void)
+{
+	struct conn **pp, *conn;
+
+	udp_conns_lock.lock();
+	pp = &udp_conns;
+	while ((conn = *pp)) {
+		if (conn->idle && conn->finished) {
+			*pp = conn->next_udp;
+			conn_unregister(conn, epollfd);
+		} else {
+			conn->idle = true;
+			pp = &conn->next_udp;
+		}
+	}
+	udp_conns_lock.unlock();
+}
+
+/* dispatcher only: the conn must leave udp_conns before it is recycled */
+static void udp_conn_unregister(struct conn *conn)
+{
+	struct conn **pp;
+
+	udp_conns_lock.lock();
+	for (pp = &udp_conns; *pp != conn; pp = &(*pp)->next_udp)
+		;
+	*pp = conn->next_udp;
+	udp_conns_lock.unlock();
+	conn_unregister(conn, epollfd);
+}
+
+static void udp_worker(struct conn *conn, int sock)
+{
+	udp_serve(conn, sock);
+	if (conn) {
+		conn->finished = true;
+		conn_put(conn);
+	}
+	worker_done();
+}
+
+/* stands for the shared socket in the pending queue */
+static struct conn udp_shared;
+
+static bool spawn_udp(void *item)
+{
+	struct conn *conn = (struct conn *) item;
+	uint64_t start_tsc = rdtsc();
+	Arachne::ThreadId tid;
+
+	if (conn == &udp_shared)
+		tid = Arachne::createThread(udp_worker, (struct conn *) NULL,
+					    udp_shared.fd);
+	else
+		tid = Arachne::createThread(udp_worker, conn, 0);
+	if (tid == Arachne::NullThread)
+		return false;
+	spawn_learn(start_tsc);
+	return true;
+}
+
+/* inline fast path: peek at the next datagram and serve it here if short */
+static bool udp_inline(struct conn *conn, int sock)
+{
+	struct payload p;
+	ssize_t ret;
+
+	stat_inc(STAT_SYSCALLS);
+	ret = recv(sock, &p, sizeof(p), MSG_PEEK | MSG_DONTWAIT);
+	if (ret == sizeof(p) && !inline_ok(&p))
+		return false;
+	if (ret > 0) {
+		udp_serve(conn, sock);
+		stat_inc(STAT_INLINE);
+	}
+	return true;
+}
+
+/* overload: drop or reject the next datagram on sock */
+static void overflow_udp(int sock)
+{
+	struct payload p;
+	struct payload_ts reply;
+	size_t len;
+	struct sockaddr_in caddr;
+	socklen_t caddr_len = sizeof(caddr);
+
+	stat_inc(STAT_SYSCALLS);
+	if (recvfrom(sock, &p, sizeof(p), MSG_DONTWAIT,
+		     (struct sockaddr *) &caddr, &caddr_len) != sizeof(p))
+		return;
+	if (overflow_policy == OVERFLOW_DROP) {
+		stat_inc(STAT_DROPS);
+		return;
+	}
+
+	/* a reject keeps the reply format the client asked for */
+	proto_set_flags(&p, PROTO_FLAG_REJECTED);
+	payload_ts_fill(&reply, &p, 0, 0, 0, 0);
+	len = proto_flags(&p) & PROTO_FLAG_TIMESTAMPS ? sizeof(reply) : sizeof(p);
+	stat_inc(STAT_SYSCALLS);
+	if (sendto(sock, &reply, len, 0, (struct sockaddr *) &caddr,
+		   caddr_len) == (ssize_t) len)
+		stat_inc(STAT_REJECTS);
 }
 
 static void dispatcher_udp(int port)
 {
+	struct dispatcher *d = &dispatchers[0];
 	int sock, i, ret;
 	int nfds;
 	struct epoll_event ev, events[CONFIG_MAX_EVENTS];
 	struct conn *conn;
+	long now, last_reclaim = mytime();
 
 	sock = socket(AF_INET, SOCK_DGRAM, 0);
 	if (!sock) {
@@ -372,58 +1030,398 @@ static void dispatcher_udp(int port)
 	ev.data.u32 = 0;
 	ret = epoll_ctl(epollfd, EPOLL_CTL_ADD, sock, &ev);
 	assert(!ret);
+	udp_shared.fd = sock;
+	pending_init(d);
 	printf("about to start epoll loop\n");
 	fflush(stdout);
 	while (1) {
-		nfds = epoll_wait(epollfd, events, CONFIG_MAX_EVENTS, -1);
-		assert(nfds > 0);
+		pending_drain(d, spawn_udp);
+		if (!pending_empty(d))
+			Arachne::yield();
+		stat_inc(STAT_SYSCALLS);
+		nfds = epoll_wait(epollfd, events, CONFIG_MAX_EVENTS,
+				  !pending_empty(d) ? 0 :
+				  udp_conns ? UDP_IDLE_MS : -1);
+		now = mytime();
+		if (now - last_reclaim >= UDP_IDLE_MS * 1000) {
+			udp_reclaim_idle();
+			last_reclaim = now;
+		}
 		for (i = 0; i < nfds; i++) {
 			if (events[i].data.u32 == 0) {
+				if (inline_enabled() && udp_inline(NULL, sock))
+					continue;
 				/* spawn an Arachne thread to handle the work and setup a new connection */
-			  while (Arachne::createThread(udp_worker, (struct conn *) NULL, sock) == Arachne::NullThread) { }
+				if (!admit(d, spawn_udp, &udp_shared))
+					overflow_udp(sock);
 			} else {
 				conn = (struct conn *) events[i].data.ptr;
+				conn->idle = false;
 
 				if (events[i].events & (EPOLLHUP | EPOLLERR)) {
 					printf("error!\n");
-					close(conn->fd);
-					/* TODO: should also free conn */
+					udp_conn_unregister(conn);
 				} else if (!conn->finished) {
 					/* conn is already being handled by another Arachne thread */
 					continue;
+				} else if (inline_enabled() && udp_inline(conn, conn->fd)) {
+					continue;
 				} else {
 					conn->finished = false;
+					conn_hold(conn);
 					/* spawn an Arachne thread to receive, do the work, and send a response */
-					while (Arachne::createThread(udp_worker, conn, 0) == Arachne::NullThread) { }
+					if (!admit(d, spawn_udp, conn)) {
+						overflow_udp(conn->fd);
+						conn->finished = true;
+						conn_put(conn);
+					}
 				}
 			}
 		}
 	}
 }
 
+static struct udp_batch *free_batches;
+static Arachne::SpinLock batch_lock;
+
+static struct udp_batch *batch_get(void)
+{
+	struct udp_batch *b;
+
+	batch_lock.lock();
+	b = free_batches;
+	if (b)
+		free_batches = b->next;
+	batch_lock.unlock();
+
+	if (!b) {
+		b = (struct udp_batch *) malloc(sizeof(*b));
+		if (!b) {
+			perror("malloc");
+			exit(1);
+		}
+	}
+
+	return b;
+}
+
+static void batch_put(struct udp_batch *b)
+{
+	batch_lock.lock();
+	b->next = free_batches;
+	free_batches = b;
+	batch_lock.unlock();
+}
+
+static void udp_batch_worker(struct udp_batch *b)
+{
+	struct payload *p;
+	uint64_t start_tsc, end_tsc;
+	int i, sent, ret;
+
+	for (i = 0; i < b->n; i++) {
+		p = &b->reqs[i];
+		start_tsc = rdtsc();
+		core_policy_record(start_tsc - b->recv_tsc);
+		run_request(p);
+		end_tsc = rdtsc();
+
+		/* reply in place, reusing the receive iovec and address */
+		b->iovs[i].iov_base = p;
+		b->iovs[i].iov_len = sizeof(*p);
+		if (proto_flags(p) & PROTO_FLAG_TIMESTAMPS) {
+			payload_ts_fill(&b->replies[i], p, tsc_to_ns(b->recv_tsc),
+					tsc_to_ns(start_tsc), tsc_to_ns(end_tsc),
+					tsc_to_ns(rdtsc()));
+			b->iovs[i].iov_base = &b->replies[i];
+			b->iovs[i].iov_len = sizeof(b->replies[i]);
+		}
+		b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+	}
+
+	for (sent = 0; sent < b->n; sent += ret) {
+		stat_inc(STAT_SYSCALLS);
+		ret = sendmmsg(b->sock, &b->msgs[sent], b->n - sent, 0);
+		if (ret <= 0) {
+			printf("udp_batch_worker: sendmmsg failed %d\n", -errno);
+			break;
+		}
+	}
+	stat_add(STAT_REQUESTS, sent);
+
+	batch_put(b);
+	worker_done();
+}
+
+static bool spawn_batch(void *item)
+{
+	uint64_t start_tsc = rdtsc();
+
+	if (Arachne::createThread(udp_batch_worker, (struct udp_batch *) item) ==
+	    Arachne::NullThread)
+		return false;
+	spawn_learn(start_tsc);
+	return true;
+}
+
+static bool batch_is_short(struct udp_batch *b)
+{
+	int i;
+
+	for (i = 0; i < b->n; i++)
+		if (!inline_ok(&b->reqs[i]))
+			return false;
+	return true;
+}
+
+/* overload: drop the whole batch, or bounce it back flagged as rejected */
+static void overflow_batch(struct udp_batch *b)
+{
+	int i, ret = 0;
+
+	if (overflow_policy == OVERFLOW_REJECT) {
+		for (i = 0; i < b->n; i++) {
+			proto_set_flags(&b->reqs[i], PROTO_FLAG_REJECTED);
+			if (!(proto_flags(&b->reqs[i]) & PROTO_FLAG_TIMESTAMPS))
+				continue;
+			/* zeroed stamps, in the format the client asked for */
+			payload_ts_fill(&b->replies[i], &b->reqs[i], 0, 0, 0, 0);
+			b->iovs[i].iov_base = &b->replies[i];
+			b->iovs[i].iov_len = sizeof(b->replies[i]);
+		}
+		stat_inc(STAT_SYSCALLS);
+		ret = sendmmsg(b->sock, b->msgs, b->n, 0);
+		stat_add(STAT_REJECTS, ret > 0 ? ret : 0);
+	}
+	stat_add(STAT_DROPS, b->n - (ret > 0 ? ret : 0));
+	batch_put(b);
+}
+
+/*
+ * Drains one of nr_dispatchers SO_REUSEPORT sockets with recvmmsg() and
+ * hands each batch to a new Arachne thread. There is no per-client socket
+ * or epoll set; replies go out on the shared socket.
+ */
+static void dispatcher_udp_batch(int port, int id)
+{
+	struct dispatcher *d = &dispatchers[id];
+	struct sockaddr_in sin;
+	struct udp_batch *b;
+	uint64_t start_tsc;
+	int sock, i, n;
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		exit(1);
+	}
+	setreuse(sock);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0);
+	sin.sin_port = htons(port);
+
+	if (bind(sock, (struct sockaddr*)&sin, sizeof(sin))) {
+		perror("bind");
+		exit(1);
+	}
+
+	printf("dispatcher_udp_batch %d\n", id);
+	fflush(stdout);
+	pending_init(d);
+	b = batch_get();
+	while (1) {
+		pending_drain(d, spawn_batch);
+		if (!pending_empty(d))
+			Arachne::yield();
+		b->sock = sock;
+		for (i = 0; i < udp_batch; i++) {
+			b->iovs[i].iov_base = &b->reqs[i];
+			b->iovs[i].iov_len = sizeof(b->reqs[i]);
+			memset(&b->msgs[i].msg_hdr, 0, sizeof(b->msgs[i].msg_hdr));
+			b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+			b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+			b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+			b->msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		/* this core is ours, so block until at least one arrives */
+		stat_inc(STAT_SYSCALLS);
+		n = recvmmsg(sock, b->msgs, udp_batch,
+			     pending_empty(d) ? MSG_WAITFORONE : MSG_DONTWAIT, NULL);
+		if (n <= 0) {
+			if (n < 0 && errno != EINTR && errno != EAGAIN)
+				perror("recvmmsg");
+			continue;
+		}
+
+		start_tsc = rdtsc();
+		b->recv_tsc = start_tsc;
+		b->n = 0;
+		for (i = 0; i < n; i++) {
+			if (b->msgs[i].msg_len != sizeof(struct payload))
+				continue;
+			if (i != b->n) {
+				b->reqs[b->n] = b->reqs[i];
+				b->addrs[b->n] = b->addrs[i];
+			}
+			b->n++;
+		}
+		d->events += b->n;
+		if (b->n && inline_enabled() && batch_is_short(b)) {
+			stat_add(STAT_INLINE, b->n);
+			udp_batch_worker(b);
+			b = batch_get();
+		} else if (b->n) {
+			if (!admit(d, spawn_batch, b))
+				overflow_batch(b);
+			b = batch_get();
+		}
+		d->busy_tsc += rdtsc() - start_tsc;
+	}
+}
+
+static void shm_worker(struct shm_conn *conn)
+{
+	struct shm_channel *ch = conn->ch;
+	struct payload payload;
+	struct payload_ts reply;
+	uint64_t recv_tsc = conn->ready_tsc, start_tsc, end_tsc;
+	const void *msg;
+	uint32_t len;
+
+	while (shm_ring_pop(&ch->req, &payload, sizeof(payload))) {
+		if (!recv_tsc)
+			recv_tsc = rdtsc();
+		start_tsc = rdtsc();
+		core_policy_record(start_tsc - recv_tsc);
+		run_request(&payload);
+		end_tsc = rdtsc();
+
+		msg = &payload;
+		len = sizeof(payload);
+		if (proto_flags(&payload) & PROTO_FLAG_TIMESTAMPS) {
+			payload_ts_fill(&reply, &payload, tsc_to_ns(recv_tsc),
+					tsc_to_ns(start_tsc), tsc_to_ns(end_tsc),
+					tsc_to_ns(rdtsc()));
+			msg = &reply;
+			len = sizeof(reply);
+		}
+		recv_tsc = 0;
+		while (!shm_ring_push(&ch->resp, msg, len))
+			Arachne::yield();
+		shm_bell_ring(&ch->client_bell);
+		stat_inc(STAT_REQUESTS);
+	}
+
+	conn->finished = true;
+}
+
+/*
+ * Shared-memory transport: poll every request ring and hand channels with
+ * pending requests to Arachne threads, just like dispatcher_tcp does for
+ * readable sockets.
+ */
+static void dispatcher_shm(void)
+{
+	struct shm_conn *conns;
+	uint64_t start_tsc;
+	bool busy;
+	int i;
+
+	conns = (struct shm_conn *) calloc(shm_channels, sizeof(*conns));
+	if (!conns) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < shm_channels; i++) {
+		conns[i].ch = &shm_region->channels[i];
+		conns[i].finished = true;
+	}
+
+	printf("dispatcher_shm\n");
+	fflush(stdout);
+	while (1) {
+		start_tsc = rdtsc();
+		busy = false;
+		for (i = 0; i < shm_channels; i++) {
+			if (!conns[i].finished || shm_ring_empty(&conns[i].ch->req))
+				continue;
+			busy = true;
+			conns[i].finished = false;
+			conns[i].ready_tsc = rdtsc();
+			if (Arachne::createThread(shm_worker, &conns[i]) ==
+			    Arachne::NullThread)
+				conns[i].finished = true; /* try again later */
+		}
+		if (!busy)
+			stat_add(STAT_SPIN_CYCLES, rdtsc() - start_tsc);
+	}
+}
+
 void init_arachne(int *argc, const char** argv)
 {
 	srand48(mytime());
 
 	Arachne::Logger::setLogLevel(Arachne::WARNING);
 	Arachne::setErrorStream(stderr);
+	core_policy_install(*argc, argv);
 	Arachne::init(argc, argv);
+	tsc_calibrate();
 	/*	reinterpret_cast<Arachne::DefaultCorePolicy*>(Arachne::getCorePolicy())
             ->getEstimator()
             ->setLoadFactorThreshold(0.1);*/
 }
 
+static int nr_active_cores(void)
+{
+	return Arachne::numActiveCores;
+}
+
 void start_arachne_server(int udp, int port)
 {
+	int i;
+
   printf("start_arachne_server\n");
   fflush(stdout);
-	/* create arachne dispatch thread */
-	if (udp)
+	if (cpu_stats)
+		stats_cpu_accounting(nr_active_cores);
+	if (alloc_strategy != ALLOC_NONE)
+		printf("allocating %d nodes of %d-%d bytes per request with %s\n",
+		       alloc_nodes, alloc_min_size, alloc_max_size, alloc_name());
+	if (split_ways > 1 || lazy_buffers || cpu_stats || inline_enabled() ||
+	    alloc_strategy != ALLOC_NONE || nr_dispatchers > 1 ||
+	    persistent_threads || udp_batch || admission_stats)
+		stats_start(1000);
+	core_policy_start();
+	if (block_mode == BLOCK_BACKEND)
+		backend_start();
+	conn_pool_grow();
+	/* create arachne dispatch threads */
+	if (shm_name) {
+		/* the dispatcher polls, so clients never need to ring us */
+		shm_region = shm_region_create(shm_name, shm_channels, 1);
 		Arachne::createThreadWithClass(Arachne::DefaultCorePolicy::EXCLUSIVE,
-					       dispatcher_udp, port);
-	else
+					       dispatcher_shm);
+	} else if (udp && !udp_batch)
 		Arachne::createThreadWithClass(Arachne::DefaultCorePolicy::EXCLUSIVE,
-					       dispatcher_tcp, port);
+					       dispatcher_udp, port);
+	else {
+		if (nr_dispatchers < 1 || nr_dispatchers > MAX_DISPATCHERS) {
+			fprintf(stderr, "invalid dispatcher count %d\n", nr_dispatchers);
+			exit(-1);
+		}
+		if (udp_batch < 0 || udp_batch > MAX_UDP_BATCH) {
+			fprintf(stderr, "invalid UDP batch size %d\n", udp_batch);
+			exit(-1);
+		}
+		stats_set_reporter(dispatcher_report);
+		for (i = 0; i < nr_dispatchers; i++)
+			Arachne::createThreadWithClass(Arachne::DefaultCorePolicy::EXCLUSIVE,
+						       udp ? dispatcher_udp_batch : dispatcher_tcp,
+						       port, i);
+	}
 
 	Arachne::waitForTermination();
 }
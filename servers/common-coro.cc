@@ -0,0 +1,519 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <pthread.h>
+#include <atomic>
+#include <coroutine>
+#include <deque>
+#include <mutex>
+
+#include "common.h"
+#include "proto.h"
+#include "request.h"
+#include "stats.h"
+
+/*
+ * M:N user-level threads on C++20 coroutines, without Arachne. Every core
+ * runs an executor with its own run queue and epoll reactor. A coroutine
+ * that finds its socket empty parks on the fd; when the fd becomes ready
+ * the reactor that notices puts the coroutine on its run queue. Executors
+ * that run dry steal half of another executor's run queue, then poll other
+ * executors' reactors, before sleeping in their own epoll_wait().
+ */
+
+#define BUFSIZE 2048
+#define BACKLOG 8192
+#define MAX_EVENTS 64
+#define MAX_THREADS 256
+
+/* coroutines resumed between non-blocking reactor polls */
+#define POLL_INTERVAL 64
+
+__thread int thread_no;
+int nr_cpu;
+int coro_steal = 1;
+
+static int listen_port;
+
+/* fire-and-forget coroutine, started by spawn() and freed on completion */
+struct task {
+	struct promise_type {
+		task get_return_object()
+		{
+			return task{std::coroutine_handle<promise_type>::from_promise(*this)};
+		}
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { abort(); }
+	};
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+struct alignas(64) executor {
+	std::mutex lock;
+	std::deque<std::coroutine_handle<>> runq;
+	std::atomic<int> nr_runnable;
+	std::atomic<bool> sleeping;
+	int epfd;
+	int wakefd;
+};
+
+/* an fd a coroutine can park on; epoll data points here */
+struct pollable {
+	int fd;
+	int epfd;
+	bool registered;
+	std::coroutine_handle<> waiter;
+};
+
+struct conn {
+	struct pollable p;
+	int buf_head;
+	int buf_tail;
+	struct req_state req;
+	unsigned char buf[BUFSIZE];
+};
+
+static struct executor *executors;
+static __thread struct executor *self;
+
+static void push_runnable(std::coroutine_handle<> *hs, int n)
+{
+	int i;
+
+	self->lock.lock();
+	for (i = 0; i < n; i++)
+		self->runq.push_back(hs[i]);
+	self->lock.unlock();
+	self->nr_runnable.fetch_add(n);
+}
+
+static void spawn(task t)
+{
+	push_runnable((std::coroutine_handle<> *) &t.handle, 1);
+}
+
+static std::coroutine_handle<> pop_runnable(void)
+{
+	std::coroutine_handle<> h;
+
+	if (!self->nr_runnable.load(std::memory_order_relaxed))
+		return nullptr;
+
+	self->lock.lock();
+	if (!self->runq.empty()) {
+		h = self->runq.front();
+		self->runq.pop_front();
+		self->nr_runnable.fetch_sub(1);
+	}
+	self->lock.unlock();
+
+	return h;
+}
+
+/* takes the newer half of a victim's run queue */
+static bool steal(void)
+{
+	std::coroutine_handle<> batch[MAX_EVENTS];
+	struct executor *victim;
+	int i, j, n = 0;
+
+	for (i = 1; i < nr_cpu && !n; i++) {
+		victim = &executors[(thread_no + i) % nr_cpu];
+		if (victim->nr_runnable.load(std::memory_order_relaxed) < 1)
+			continue;
+
+		victim->lock.lock();
+		n = (victim->runq.size() + 1) / 2;
+		if (n > MAX_EVENTS)
+			n = MAX_EVENTS;
+		for (j = 0; j < n; j++) {
+			batch[j] = victim->runq.back();
+			victim->runq.pop_back();
+		}
+		victim->lock.unlock();
+		victim->nr_runnable.fetch_sub(n);
+	}
+
+	if (!n)
+		return false;
+	push_runnable(batch, n);
+	stat_add(STAT_STEALS, n);
+	return true;
+}
+
+static bool anything_runnable(void)
+{
+	int i;
+
+	for (i = 0; i < nr_cpu; i++) {
+		if (executors[i].nr_runnable.load() > 0)
+			return true;
+	}
+
+	return false;
+}
+
+/* there is more work here than one core can do, get help */
+static void wake_idle(void)
+{
+	int i;
+	uint64_t one = 1;
+	struct executor *e;
+
+	for (i = 1; i < nr_cpu; i++) {
+		e = &executors[(thread_no + i) % nr_cpu];
+		if (e->sleeping.load() && e->sleeping.exchange(false)) {
+			if (write(e->wakefd, &one, sizeof(one)) != sizeof(one)) {
+				perror("write(eventfd)");
+				exit(1);
+			}
+			return;
+		}
+	}
+}
+
+/*
+ * Harvests readiness events from @e's reactor onto our own run queue.
+ * Returns the number of coroutines made runnable.
+ */
+static int reactor_poll(struct executor *e, int timeout)
+{
+	struct epoll_event events[MAX_EVENTS];
+	std::coroutine_handle<> ready[MAX_EVENTS];
+	struct pollable *p;
+	uint64_t val;
+	int i, nfds, n = 0;
+
+	nfds = epoll_wait(e->epfd, events, MAX_EVENTS, timeout);
+	if (nfds < 0) {
+		if (errno == EINTR)
+			return 0;
+		perror("epoll_wait");
+		exit(1);
+	}
+
+	for (i = 0; i < nfds; i++) {
+		p = (struct pollable *) events[i].data.ptr;
+		if (!p) {
+			if (read(e->wakefd, &val, sizeof(val)) < 0 && errno != EAGAIN) {
+				perror("read(eventfd)");
+				exit(1);
+			}
+			continue;
+		}
+		ready[n++] = p->waiter;
+		p->waiter = nullptr;
+	}
+
+	if (n) {
+		push_runnable(ready, n);
+		if (coro_steal && self->nr_runnable.load() > 1)
+			wake_idle();
+	}
+
+	return n;
+}
+
+static bool poll_others(void)
+{
+	int i;
+
+	for (i = 1; i < nr_cpu; i++) {
+		if (reactor_poll(&executors[(thread_no + i) % nr_cpu], 0))
+			return true;
+	}
+
+	return false;
+}
+
+static void executor_loop(void)
+{
+	std::coroutine_handle<> h;
+	unsigned int ran = 0;
+
+	while (1) {
+		h = pop_runnable();
+		if (h) {
+			h.resume();
+			if (++ran % POLL_INTERVAL == 0)
+				reactor_poll(self, 0);
+			continue;
+		}
+
+		if (reactor_poll(self, 0))
+			continue;
+		if (coro_steal && (steal() || poll_others()))
+			continue;
+
+		/* pairs with the sleeping check in wake_idle() */
+		self->sleeping.store(true);
+		if (coro_steal && anything_runnable()) {
+			self->sleeping.store(false);
+			continue;
+		}
+		reactor_poll(self, -1);
+		self->sleeping.store(false);
+	}
+}
+
+/*
+ * Parks the calling coroutine until @p is ready. The fd is armed one-shot,
+ * so exactly one reactor sees the event and the coroutine is resumed once.
+ */
+struct io_wait {
+	struct pollable *p;
+	uint32_t events;
+
+	bool await_ready() { return false; }
+	void await_suspend(std::coroutine_handle<> h)
+	{
+		struct epoll_event ev;
+		int op = p->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+		p->waiter = h;
+		p->registered = true;
+		ev.events = events | EPOLLONESHOT;
+		ev.data.ptr = p;
+		/* after this we may already be running on another core */
+		if (epoll_ctl(p->epfd, op, p->fd, &ev)) {
+			perror("epoll_ctl");
+			exit(1);
+		}
+	}
+	void await_resume() {}
+};
+
+static ssize_t coro_recv(void *arg, void *buf, size_t len)
+{
+	struct conn *conn = (struct conn *) arg;
+
+	return req_buf_recv(conn->p.fd, conn->buf, BUFSIZE, &conn->buf_head,
+			    &conn->buf_tail, buf, len);
+}
+
+static ssize_t coro_send(void *arg, const void *buf, size_t len)
+{
+	struct conn *conn = (struct conn *) arg;
+	ssize_t ret;
+
+	stat_inc(STAT_SYSCALLS);
+	ret = send(conn->p.fd, buf, len, MSG_NOSIGNAL);
+	return ret < 0 ? -errno : ret;
+}
+
+/*
+ * work() cannot suspend, so a blocking request sleeps its executor, and
+ * with it every coroutine queued there, like a kernel thread in spin-linux.
+ */
+static void coro_work(void *arg, struct req_state *st)
+{
+	uint64_t iterations = proto_iterations(&st->payload);
+	uint64_t ns = proto_block_us(&st->payload) * 1000ull;
+	struct timespec ts = { (time_t) (ns / 1000000000), (long) (ns % 1000000000) };
+
+	if (!(proto_flags(&st->payload) & PROTO_FLAG_BLOCKING)) {
+		do_work(iterations);
+		return;
+	}
+
+	do_work(iterations / 2);
+	stat_inc(STAT_BLOCKS);
+	stat_inc(STAT_SYSCALLS);
+	nanosleep(&ts, NULL);
+	do_work(iterations - iterations / 2);
+}
+
+static const struct transport coro_transport = {
+	coro_recv, coro_send, coro_work, NULL, NULL,
+};
+
+/* parks on the fd whenever req_drive() would block */
+static task tcp_worker(struct conn *conn)
+{
+	bool open = true;
+
+	req_init(&conn->req);
+	while (open) {
+		switch (req_drive(&conn->req, conn, &coro_transport)) {
+		case REQ_WANT_RECV:
+			co_await io_wait{&conn->p, EPOLLIN};
+			break;
+		case REQ_WANT_SEND:
+			co_await io_wait{&conn->p, EPOLLOUT};
+			break;
+		default:
+			open = false;
+		}
+	}
+
+	close(conn->p.fd);
+	stat_inc(STAT_CLOSES);
+	delete conn;
+}
+
+static task acceptor(struct pollable *listener)
+{
+	struct conn *conn;
+	int fd;
+
+	while (1) {
+		fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK);
+		if (fd < 0) {
+			switch (errno) {
+			case EAGAIN:
+				co_await io_wait{listener, EPOLLIN};
+				continue;
+			case EINTR:
+			case ECONNABORTED:
+				continue;
+			default:
+				perror("accept4");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		/* the conn's reactor is whichever core accepted it */
+		conn = new struct conn;
+		conn->p.fd = fd;
+		conn->p.epfd = self->epfd;
+		conn->p.registered = false;
+		conn->buf_head = 0;
+		conn->buf_tail = 0;
+		stat_inc(STAT_ACCEPTS);
+		spawn(tcp_worker(conn));
+	}
+}
+
+static int listen_socket(void)
+{
+	struct sockaddr_in sin;
+	int sock, one;
+
+	sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (sock < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	one = 1;
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (void *) &one, sizeof(one))) {
+		perror("setsockopt(SO_REUSEPORT)");
+		exit(1);
+	}
+
+	one = 1;
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *) &one, sizeof(one))) {
+		perror("setsockopt(SO_REUSEADDR)");
+		exit(1);
+	}
+
+	/* inherited by accepted sockets */
+	one = 1;
+	if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *) &one, sizeof(one))) {
+		perror("setsockopt(TCP_NODELAY)");
+		exit(1);
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0);
+	sin.sin_port = htons(listen_port);
+
+	if (bind(sock, (struct sockaddr*)&sin, sizeof(sin))) {
+		perror("bind");
+		exit(1);
+	}
+
+	if (listen(sock, BACKLOG)) {
+		perror("listen");
+		exit(1);
+	}
+
+	return sock;
+}
+
+static void *executor_main(void *arg)
+{
+	struct pollable *listener;
+
+	thread_no = (long) arg;
+	self = &executors[thread_no];
+
+	init_thread();
+
+	listener = new struct pollable;
+	listener->fd = listen_socket();
+	listener->epfd = self->epfd;
+	listener->registered = false;
+	spawn(acceptor(listener));
+
+	executor_loop();
+
+	return NULL;
+}
+
+void init_coro(int n_cpu, int port)
+{
+	srand48(mytime());
+	nr_cpu = n_cpu;
+	listen_port = port;
+	tsc_calibrate();
+}
+
+void start_coro_server(void)
+{
+	struct epoll_event ev;
+	pthread_t tid;
+	int i;
+
+	if (nr_cpu < 1 || nr_cpu > MAX_THREADS) {
+		fprintf(stderr, "invalid thread count %d\n", nr_cpu);
+		exit(-1);
+	}
+
+	/* every reactor must exist before anyone polls or wakes it */
+	executors = new struct executor[nr_cpu];
+	for (i = 0; i < nr_cpu; i++) {
+		executors[i].nr_runnable = 0;
+		executors[i].sleeping = false;
+		executors[i].epfd = epoll_create1(0);
+		if (executors[i].epfd < 0) {
+			perror("epoll_create1");
+			exit(-1);
+		}
+		executors[i].wakefd = eventfd(0, EFD_NONBLOCK);
+		if (executors[i].wakefd < 0) {
+			perror("eventfd");
+			exit(-1);
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(executors[i].epfd, EPOLL_CTL_ADD, executors[i].wakefd, &ev)) {
+			perror("epoll_ctl: EPOLL_CTL_ADD");
+			exit(-1);
+		}
+	}
+
+	printf("starting coroutine server with %d executors, port %d%s\n",
+	       nr_cpu, listen_port, coro_steal ? "" : ", no work stealing");
+	fflush(stdout);
+	stats_start(1000);
+	for (i = 1; i < nr_cpu; i++) {
+		if (pthread_create(&tid, NULL, executor_main, (void *) (long) i)) {
+			fprintf(stderr, "failed to spawn thread %d\n", i);
+			exit(-1);
+		}
+	}
+
+	executor_main(0);
+}
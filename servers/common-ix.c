@@ -7,26 +7,14 @@
 
 #include "common.h"
 #include "memcached.h"
+#include "proto.h"
+#include "request.h"
 
 #define ROUND_UP(num, multiple) ((((num) + (multiple) - 1) / (multiple)) * (multiple))
 
-struct payload {
-	uint64_t work_iterations;
-	uint64_t index;
-};
-
-enum spin_conn_state {
-	STATE_RECEIVE = 1,
-	STATE_SPIN,
-	STATE_SEND,
-};
-
 struct conn {
 	struct ixev_ctx ctx;
-	enum spin_conn_state state;
-	int partial;
-	binary_header_t header;
-	struct payload payload;
+	struct req_state req;
 };
 
 static struct mempool_datastore conn_datastore;
@@ -44,126 +32,43 @@ int nr_cpu;
 
 static void handler(struct ixev_ctx *ctx, unsigned int reason);
 
-static bool recv_exactly(struct ixev_ctx *ctx, void *buf, int size)
+static ssize_t ix_recv(void *arg, void *buf, size_t len)
 {
-	ssize_t ret;
-	char *cbuf = (char *) buf;
-	struct conn *conn = container_of(ctx, struct conn, ctx);
+	struct conn *conn = arg;
 
-	assert(size >= 0);
-	while (conn->partial < size) {
-		ret = ixev_recv(ctx, &cbuf[conn->partial], size - conn->partial);
-		if (ret == -EAGAIN)
-			return false;
-		if (ret == -EIO) {
-			ixev_close(ctx);
-			return false;
-		}
-		assert(ret > 0);
-		conn->partial += ret;
-	}
-	assert(conn->partial == size);
-	conn->partial = 0;
-	return true;
+	return ixev_recv(&conn->ctx, buf, len);
 }
 
-static bool send_exactly(struct ixev_ctx *ctx, void *buf, int size)
+static ssize_t ix_send(void *arg, const void *buf, size_t len)
 {
-	ssize_t ret;
-	char *cbuf = (char *) buf;
-	struct conn *conn = container_of(ctx, struct conn, ctx);
+	struct conn *conn = arg;
 
-	assert(size >= 0);
-	while (conn->partial < size) {
-		ret = ixev_send(ctx, &cbuf[conn->partial], size - conn->partial);
-		if (ret == -EAGAIN)
-			return false;
-		assert(ret > 0);
-		conn->partial += ret;
-	}
-	assert(conn->partial == size);
-	conn->partial = 0;
-	return true;
+	return ixev_send(&conn->ctx, (void *) buf, len);
 }
 
-/*static bool drain_exactly(struct ixev_ctx *ctx, int size)
-{
-	ssize_t ret;
-	char buf[4096];
-	struct conn *conn = container_of(ctx, struct conn, ctx);
-
-	assert(size >= 0);
-	while (conn->partial < size) {
-		ret = ixev_recv(ctx, buf, min(sizeof(buf), size - conn->partial));
-		if (ret == -EAGAIN)
-			return false;
-		assert(ret > 0);
-		conn->partial += ret;
-	}
-	assert(conn->partial == size);
-	conn->partial = 0;
-	return true;
-	}*/
-
-uint64_t ntohll(uint64_t value)
+static void ix_work(void *arg, struct req_state *st)
 {
-	/* really lazy, assumes a specific endianness */
-
-	const uint32_t high_part = ntohl((uint32_t) (value >> 32));
-	const uint32_t low_part = ntohl((uint32_t) (value & 0xFFFFFFFFLL));
-
-	return (((uint64_t) low_part) << 32) | high_part;
+	do_work(ntohll(st->payload.work_iterations));
 }
 
-static bool drive_machine(struct ixev_ctx *ctx, unsigned int reason)
-{
-	bool ok;
-	struct conn *conn = container_of(ctx, struct conn, ctx);
-
-	switch (conn->state) {
-	case STATE_RECEIVE:
-		ok = recv_exactly(ctx, &conn->payload, sizeof(conn->payload));
-		if (!ok)
-			return true;
-		conn->state = STATE_SPIN;
-		/* fallthrough */
-	case STATE_SPIN:
-		do_work(ntohll(conn->payload.work_iterations));
-		conn->state = STATE_SEND;
-		/* fallthrough */
-	case STATE_SEND:
-		ok = send_exactly(ctx, &conn->payload, sizeof(conn->payload));
-		if (!ok)
-			return true;
-		conn->state = STATE_RECEIVE;
-		break;
-	default:
-		assert(0);
-	}
-
-	return false;
-}
+static const struct transport ix_transport = {
+	ix_recv, ix_send, ix_work, NULL, NULL,
+};
 
 static void handler(struct ixev_ctx *ctx, unsigned int reason)
 {
-	bool stop;
 	struct conn *conn = container_of(ctx, struct conn, ctx);
 
-	while (1) {
-		stop = drive_machine(ctx, reason);
-		if (stop)
-			break;
-	}
-
-	switch (conn->state) {
-	case STATE_RECEIVE:
+	switch (req_drive(&conn->req, conn, &ix_transport)) {
+	case REQ_WANT_RECV:
 		ixev_set_handler(&conn->ctx, IXEVIN, &handler);
 		break;
-	case STATE_SPIN:
-		assert(0);
-	case STATE_SEND:
+	case REQ_WANT_SEND:
 		ixev_set_handler(&conn->ctx, IXEVOUT, &handler);
 		break;
+	case REQ_CLOSED:
+		ixev_close(ctx);
+		break;
 	default:
 		assert(0);
 	}
@@ -173,8 +78,7 @@ static struct ixev_ctx *tcp_accept(struct ip_tuple *id)
 {
 	struct conn *conn = mempool_alloc(&conn_pool);
 	assert(conn);
-	conn->state = STATE_RECEIVE;
-	conn->partial = 0;
+	req_init(&conn->req);
 	ixev_ctx_init(&conn->ctx);
 	ixev_set_handler(&conn->ctx, IXEVIN, &handler);
 
@@ -324,6 +228,7 @@ void init_ix(int udp)
 	unsigned int conn_pool_entries;
 
 	srand48(mytime());
+	tsc_calibrate();
 
 	conn_pool_entries = ROUND_UP(16384, MEMPOOL_DEFAULT_CHUNKSIZE);
 
@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "common.h"
+#include "proto.h"
+#include "request.h"
+#include "stats.h"
+
+/*
+ * Classic blocking server: one kernel thread per connection, either
+ * spawned on accept or taken from a pre-spawned pool, doing plain
+ * blocking recv()/send() through the shared request state machine.
+ */
+
+#define BUFSIZE 2048
+#define BACKLOG 8192
+
+struct conn {
+	int fd;
+	int buf_head;
+	int buf_tail;
+	struct conn *next;
+	unsigned char buf[BUFSIZE];
+};
+
+static int listen_port;
+static int pool_size;
+static size_t stack_size;
+static pthread_attr_t thread_attr;
+
+/* connections waiting for a pool thread */
+static struct conn *queue_head, *queue_tail;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+static long base_vm_kb, base_rss_kb;
+static struct rusage last_usage;
+
+static ssize_t threads_recv(void *arg, void *buf, size_t len)
+{
+	struct conn *conn = arg;
+
+	return req_buf_recv(conn->fd, conn->buf, BUFSIZE, &conn->buf_head,
+			    &conn->buf_tail, buf, len);
+}
+
+static ssize_t threads_send(void *arg, const void *buf, size_t len)
+{
+	struct conn *conn = arg;
+	ssize_t ret;
+
+	stat_inc(STAT_SYSCALLS);
+	ret = send(conn->fd, buf, len, MSG_NOSIGNAL);
+	return ret < 0 ? -errno : ret;
+}
+
+/* a blocking request just sleeps: only this conn's thread waits */
+static void threads_work(void *arg, struct req_state *st)
+{
+	uint64_t iterations = proto_iterations(&st->payload);
+	uint64_t ns = proto_block_us(&st->payload) * 1000ull;
+	struct timespec ts = { (time_t) (ns / 1000000000), (long) (ns % 1000000000) };
+
+	if (!(proto_flags(&st->payload) & PROTO_FLAG_BLOCKING)) {
+		do_work(iterations);
+		return;
+	}
+
+	do_work(iterations / 2);
+	stat_inc(STAT_BLOCKS);
+	stat_inc(STAT_SYSCALLS);
+	nanosleep(&ts, NULL);
+	do_work(iterations - iterations / 2);
+}
+
+/* blocking sockets: req_drive() only comes back when the conn is done */
+static const struct transport blocking_transport = {
+	threads_recv, threads_send, threads_work, NULL, NULL,
+};
+
+static void serve(struct conn *conn)
+{
+	struct req_state st;
+
+	req_init(&st);
+	while (req_drive(&st, conn, &blocking_transport) != REQ_CLOSED)
+		;
+
+	close(conn->fd);
+	stat_inc(STAT_CLOSES);
+	free(conn);
+}
+
+static void *conn_thread_main(void *arg)
+{
+	init_thread();
+	serve((struct conn *) arg);
+	stats_unregister_thread();
+
+	return NULL;
+}
+
+static void *pool_thread_main(void *arg)
+{
+	struct conn *conn;
+
+	init_thread();
+
+	while (1) {
+		pthread_mutex_lock(&queue_lock);
+		while (!queue_head)
+			pthread_cond_wait(&queue_cond, &queue_lock);
+		conn = queue_head;
+		queue_head = conn->next;
+		if (!queue_head)
+			queue_tail = NULL;
+		pthread_mutex_unlock(&queue_lock);
+
+		serve(conn);
+	}
+
+	return NULL;
+}
+
+static void enqueue(struct conn *conn)
+{
+	conn->next = NULL;
+	pthread_mutex_lock(&queue_lock);
+	if (queue_tail)
+		queue_tail->next = conn;
+	else
+		queue_head = conn;
+	queue_tail = conn;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+/*
+ * Memory is reported as the growth since startup divided by the number of
+ * open connections. Kernel-side costs (kernel stacks, task structs) do not
+ * show up in either number.
+ */
+static void report(double secs)
+{
+	struct rusage usage;
+	long conns, vm_kb, rss_kb;
+
+	getrusage(RUSAGE_SELF, &usage);
+	stats_mem_kb(&vm_kb, &rss_kb);
+	conns = stats_sum(STAT_ACCEPTS) - stats_sum(STAT_CLOSES);
+
+	printf("threads: conns=%ld vcsw/s=%.0f ivcsw/s=%.0f rss=%ldKB vm=%ldKB",
+	       conns, (usage.ru_nvcsw - last_usage.ru_nvcsw) / secs,
+	       (usage.ru_nivcsw - last_usage.ru_nivcsw) / secs, rss_kb, vm_kb);
+	if (conns > 0)
+		printf(" rss/conn=%.1fKB vm/conn=%.1fKB",
+		       (double) (rss_kb - base_rss_kb) / conns,
+		       (double) (vm_kb - base_vm_kb) / conns);
+	printf("\n");
+
+	last_usage = usage;
+}
+
+static int listen_socket(void)
+{
+	struct sockaddr_in sin;
+	int sock, one;
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	one = 1;
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *) &one, sizeof(one))) {
+		perror("setsockopt(SO_REUSEADDR)");
+		exit(1);
+	}
+
+	/* inherited by accepted sockets */
+	one = 1;
+	if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *) &one, sizeof(one))) {
+		perror("setsockopt(TCP_NODELAY)");
+		exit(1);
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0);
+	sin.sin_port = htons(listen_port);
+
+	if (bind(sock, (struct sockaddr*)&sin, sizeof(sin))) {
+		perror("bind");
+		exit(1);
+	}
+
+	if (listen(sock, BACKLOG)) {
+		perror("listen");
+		exit(1);
+	}
+
+	return sock;
+}
+
+void init_linux_threads(int port, int pool, size_t stack_kb)
+{
+	srand48(mytime());
+	tsc_calibrate();
+
+	listen_port = port;
+	pool_size = pool;
+	stack_size = stack_kb * 1024;
+}
+
+void start_linux_threads_server(void)
+{
+	struct conn *conn;
+	pthread_t tid;
+	int i, sock, conn_sock;
+
+	pthread_attr_init(&thread_attr);
+	pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+	if (stack_size && pthread_attr_setstacksize(&thread_attr, stack_size)) {
+		fprintf(stderr, "invalid stack size %zu\n", stack_size);
+		exit(-1);
+	}
+
+	sock = listen_socket();
+
+	printf("starting linux thread-per-connection server, port %d, %s",
+	       listen_port, pool_size ? "pool of " : "thread per accept");
+	if (pool_size)
+		printf("%d threads", pool_size);
+	if (stack_size)
+		printf(", %zu KB stacks", stack_size / 1024);
+	printf("\n");
+	fflush(stdout);
+
+	for (i = 0; i < pool_size; i++) {
+		if (pthread_create(&tid, &thread_attr, pool_thread_main, NULL)) {
+			fprintf(stderr, "failed to spawn thread %d\n", i);
+			exit(-1);
+		}
+	}
+
+	stats_mem_kb(&base_vm_kb, &base_rss_kb);
+	getrusage(RUSAGE_SELF, &last_usage);
+	stats_set_reporter(report);
+	stats_start(1000);
+
+	while (1) {
+		conn_sock = accept(sock, NULL, NULL);
+		if (conn_sock == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			exit(EXIT_FAILURE);
+		}
+
+		conn = malloc(sizeof(*conn));
+		if (!conn) {
+			perror("malloc");
+			exit(1);
+		}
+		conn->fd = conn_sock;
+		conn->buf_head = 0;
+		conn->buf_tail = 0;
+		stat_inc(STAT_ACCEPTS);
+
+		if (pool_size) {
+			enqueue(conn);
+		} else if (pthread_create(&tid, &thread_attr, conn_thread_main, conn)) {
+			/* out of threads: this is where the model stops scaling */
+			fprintf(stderr, "failed to spawn thread for connection\n");
+			close(conn_sock);
+			stat_inc(STAT_CLOSES);
+			free(conn);
+		}
+	}
+}
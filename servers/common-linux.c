@@ -5,39 +5,80 @@
 #include <fcntl.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/resource.h>
 
+#include "alloc.h"
+#include "backend.h"
 #include "config.h"
 #include "common.h"
+#include "forkjoin.h"
 #include "memcached.h"
+#include "proto.h"
+#include "request.h"
+#include "shm-ring.h"
+#include "sockbuf.h"
+#include "stage.h"
+#include "stats.h"
 
-#define BUFSIZE 2048
+#define CONN_POOL_CHUNK 256
+#define SHM_SPIN_ROUNDS 1000
 
-struct payload {
-	uint64_t work_iterations;
-	uint64_t index;
+/*
+ * How readiness events are spread over the per-thread epoll sets. The
+ * event loop is specialized for each strategy, so picking one at runtime
+ * adds no branches to the request path.
+ */
+enum dispatch_mode {
+	DISPATCH_LOCK,		/* fd in every epoll set, CAS lock per conn */
+	DISPATCH_EXCLUSIVE,	/* same, registered with EPOLLEXCLUSIVE */
+	DISPATCH_SINGLE,	/* fd only in the accepting thread's epoll set */
+	DISPATCH_ONESHOT,	/* one shared epoll set, EPOLLONESHOT re-arm */
+	DISPATCH_BALANCE,	/* single, plus load-aware placement and migration */
+	DISPATCH_PIPELINE,	/* oneshot receive stage, then work and send stages */
+	NR_DISPATCH_MODES,
 };
 
-enum spin_conn_state {
-	STATE_RECEIVE = 1,
-	STATE_SPIN,
-	STATE_SEND,
+#if !CONFIG_REGISTER_FD_TO_ALL_EPOLLS
+#define DEFAULT_DISPATCH DISPATCH_SINGLE
+#elif CONFIG_USE_EPOLLEXCLUSIVE
+#define DEFAULT_DISPATCH DISPATCH_EXCLUSIVE
+#else
+#define DEFAULT_DISPATCH DISPATCH_LOCK
+#endif
+
+/* several threads may see events for the same conn */
+#define DISPATCH_SHARES_FDS(mode) \
+	((mode) == DISPATCH_LOCK || (mode) == DISPATCH_EXCLUSIVE)
+
+/* one epoll set shared by all threads, fds disarmed while they are served */
+#define DISPATCH_ONESHOT_SET(mode) \
+	((mode) == DISPATCH_ONESHOT || (mode) == DISPATCH_PIPELINE)
+
+static const char *dispatch_names[NR_DISPATCH_MODES] = {
+	[DISPATCH_LOCK]		= "lock",
+	[DISPATCH_EXCLUSIVE]	= "exclusive",
+	[DISPATCH_SINGLE]	= "single",
+	[DISPATCH_ONESHOT]	= "oneshot",
+	[DISPATCH_BALANCE]	= "balance",
+	[DISPATCH_PIPELINE]	= "pipeline",
 };
 
 struct conn {
-#if CONFIG_REGISTER_FD_TO_ALL_EPOLLS
 	volatile int lock;
-#endif
 	int fd;
-	enum spin_conn_state state;
-	struct payload payload;
-	int buf_head;
-	int buf_tail;
-	unsigned char buf[BUFSIZE];
+	struct req_state req;
+	struct sock_buf rx;
+	struct conn *next_free;
+
+	/* pipeline dispatch: requests in flight, then maybe a partial one */
+	int pipe_n;
+	struct req_state *pipe;
 };
 
 #define BACKLOG 8192
@@ -48,165 +89,544 @@ static int epollfd[MAX_THREADS];
 __thread int thread_no;
 int nr_cpu;
 int listen_port;
+int churn_mode;
+const char *shm_name;
+int shm_channels;
+static int dispatch_mode = -1;
+static struct shm_region *shm_region;
+int balance_interval_ms = CONFIG_BALANCE_INTERVAL_MS;
+int balance_threshold = CONFIG_BALANCE_THRESHOLD;
+uint64_t split_threshold;
+int split_ways = 1;
+int lazy_buffers;
+int block_mode;
+int memory_stats;
+int cpu_stats;
+int pipeline_work_threads;
+int pipeline_send_threads;
+static long base_rss_kb;
+
+/*
+ * Balance mode bookkeeping. Each conn is owned by the one thread whose
+ * epoll set holds it; only the owner may move it to another set. The
+ * rebalancer thread turns busy_tsc into load_pct every interval and asks
+ * an overloaded thread to hand its next active conn to an idle one.
+ */
+struct thread_load {
+	volatile uint64_t busy_tsc;	/* time spent running conns */
+	volatile int nr_conns;
+	volatile int load_pct;		/* busy share of the last interval */
+	volatile int migrate_to;	/* -1, or target for the next conn */
+} __attribute__((aligned(64)));
+
+static struct thread_load thread_loads[MAX_THREADS];
+
+/*
+ * Pipeline dispatch. The epoll threads are the receive stage: they parse
+ * up to CONFIG_PIPELINE_DEPTH requests of a conn and hand the conn to the
+ * work stage, which runs them and passes it on to the send stage. That
+ * one replies with a single send() and re-arms the conn; until then its
+ * EPOLLONESHOT registration keeps the conn out of everybody else's hands,
+ * so replies leave in order. Work and send have pools of their own.
+ */
+static struct stage work_stage, send_stage;
+
+/*
+ * Unless fds are shared between epoll sets, closed conns are recycled
+ * through per-thread pools.
+ */
+static __thread struct conn *conn_free_list;
+static __thread struct conn *conn_deferred_list;
+
+/* receive buffers; see sockbuf.h */
+static __thread struct sock_buf_pool rx_pool = SOCK_BUF_POOL_INIT;
 
 static int avail_bytes(struct conn *conn)
 {
-	return conn->buf_tail - conn->buf_head;
+	return sock_buf_avail(&conn->rx);
 }
 
-static int recv_exactly(struct conn *conn, void *buf, size_t size)
+static void conn_settle_buf(struct conn *conn)
 {
-	ssize_t ret;
-	if (avail_bytes(conn) < size) {
-		if (conn->buf_head) {
-			memmove(conn->buf, &conn->buf[conn->buf_head], avail_bytes(conn));
-			conn->buf_tail -= conn->buf_head;
-			conn->buf_head = 0;
+	if (conn->fd >= 0)
+		sock_buf_settle(&conn->rx, &rx_pool);
+}
+
+static ssize_t linux_recv(void *arg, void *buf, size_t len)
+{
+	struct conn *conn = arg;
+
+	return sock_recv(conn->fd, &conn->rx, &rx_pool, SOCK_BUF_SIZE, buf, len);
+}
+
+static ssize_t linux_send(void *arg, const void *buf, size_t len)
+{
+	struct conn *conn = arg;
+
+	return sock_send(conn->fd, buf, len);
+}
+
+static struct conn *conn_alloc(void)
+{
+	struct conn *conn;
+	int i;
+
+	if (DISPATCH_SHARES_FDS(dispatch_mode))
+		return malloc(sizeof(struct conn));
+
+	if (!conn_free_list) {
+		conn = malloc(sizeof(struct conn) * CONN_POOL_CHUNK);
+		if (!conn) {
+			perror("malloc");
+			exit(1);
 		}
-		while (conn->buf_tail < size) {
-			assert(BUFSIZE - conn->buf_tail > 0);
-			ret = recv(conn->fd, &conn->buf[conn->buf_tail], BUFSIZE - conn->buf_tail, 0);
-			if (ret <= 0)
-				return ret;
-			conn->buf_tail += ret;
+		for (i = 0; i < CONN_POOL_CHUNK; i++) {
+			conn[i].pipe = NULL;
+			conn[i].next_free = conn_free_list;
+			conn_free_list = &conn[i];
 		}
 	}
-	memcpy(buf, &conn->buf[conn->buf_head], size);
-	conn->buf_head += size;
 
-	return 1;
+	conn = conn_free_list;
+	conn_free_list = conn->next_free;
+	return conn;
 }
 
-static int send_exactly(struct conn *conn, void *buf, size_t size)
+static void conn_close(struct conn *conn)
 {
-	ssize_t ret;
-	char *cbuf = (char *) buf;
-	size_t partial = 0;
+	stat_inc(STAT_SYSCALLS);
+	close(conn->fd);
+	conn->fd = -1;
+	sock_buf_release(&conn->rx, &rx_pool);
+	stat_inc(STAT_CLOSES);
+	if (dispatch_mode == DISPATCH_BALANCE)
+		__sync_fetch_and_sub(&thread_loads[thread_no].nr_conns, 1);
+	if (DISPATCH_SHARES_FDS(dispatch_mode)) {
+		/* TODO: should also free conn */
+		return;
+	}
 
-	while (partial < size) {
-		ret = send(conn->fd, &cbuf[partial], size - partial, MSG_NOSIGNAL);
-		if (ret <= 0)
-			return ret;
-		partial += ret;
+	/*
+	 * No other thread can see this conn anymore, but it may still be
+	 * referenced by the current batch of events, so it only goes back
+	 * to the pool once the batch is done.
+	 */
+	conn->next_free = conn_deferred_list;
+	conn_deferred_list = conn;
+}
+
+static void conn_flush_deferred(void)
+{
+	struct conn *conn;
+
+	while (conn_deferred_list) {
+		conn = conn_deferred_list;
+		conn_deferred_list = conn->next_free;
+		conn->next_free = conn_free_list;
+		conn_free_list = conn;
 	}
+}
 
-	return 1;
+static void run_work(uint64_t iterations)
+{
+	uint64_t start_tsc;
+
+	/* the fork-join pool does its own accounting */
+	if (split_ways > 1 && iterations >= split_threshold) {
+		fj_run(iterations, split_ways);
+		stat_inc(STAT_SPLITS);
+		return;
+	}
+
+	start_tsc = rdtsc();
+	do_work(iterations);
+	stat_add(STAT_WORK_CYCLES, rdtsc() - start_tsc);
 }
 
-/*static int drain_exactly(struct conn *conn, size_t size)
+/* blocks this kernel thread, and with it every conn it would serve next */
+static void block(uint64_t ns)
 {
-	ssize_t ret;
-	char buf[2048];
-	size_t left;
-
-	if (avail_bytes(conn) < size) {
-		left = size;
-		left -= avail_bytes(conn);
-		conn->buf_head = 0;
-		conn->buf_tail = 0;
-		assert(left < sizeof(buf));
-		while (left) {
-			assert(left > 0);
-			ret = recv(conn->fd, buf, left, 0);
-			if (ret <= 0)
-				return ret;
-			left -= ret;
-		}
-	} else {
-		conn->buf_head += size;
+	struct timespec ts = { (time_t) (ns / 1000000000), (long) (ns % 1000000000) };
+
+	stat_inc(STAT_BLOCKS);
+	if (block_mode == BLOCK_BACKEND) {
+		backend_call(ns);
+		return;
+	}
+	stat_inc(STAT_SYSCALLS);
+	nanosleep(&ts, NULL);
+}
+
+static void run_request(const struct payload *p)
+{
+	uint64_t iterations = proto_iterations(p);
+
+	if (alloc_strategy != ALLOC_NONE)
+		alloc_work();
+	if (!(proto_flags(p) & PROTO_FLAG_BLOCKING)) {
+		run_work(iterations);
+		return;
 	}
 
-	return 1;
-	}*/
+	run_work(iterations / 2);
+	block(proto_block_us(p) * 1000ull);
+	run_work(iterations - iterations / 2);
+}
 
-static int handle_ret(struct conn *conn, ssize_t ret, int line)
+static void linux_work(void *arg, struct req_state *st)
 {
-	if (ret == 0) {
-		close(conn->fd);
-		/* TODO: should also free conn */
-		return 1;
-	} else if (ret == -1) {
-		switch (errno) {
-		case EAGAIN:
-		case EBADF:
-			return 1;
-		case EPIPE:
-		case ECONNRESET:
-			close(conn->fd);
-			/* TODO: should also free conn */
-			return 1;
-		default:
-			fprintf(stderr, "Unexpected errno %d at line %d\n", errno, line);
+	run_request(&st->payload);
+}
+
+/* level-triggered epoll reports the rest, so skip a recv() that would block */
+static bool linux_more(void *arg)
+{
+	return avail_bytes(arg) >= (int) sizeof(struct payload);
+}
+
+static const struct transport linux_transport = {
+	linux_recv, linux_send, linux_work, linux_more, NULL,
+};
+
+static void drive_machine(struct conn *conn)
+{
+	if (req_drive(&conn->req, conn, &linux_transport) == REQ_CLOSED)
+		conn_close(conn);
+}
+
+/*
+ * Least recently loaded thread, ties broken by conn count. Loads are
+ * compared in 5% steps so that idle threads tie and get conns in turn.
+ */
+static int balance_place(void)
+{
+	int i, best = thread_no;
+	uint64_t key, best_key = UINT64_MAX;
+
+	for (i = 0; i < nr_cpu; i++) {
+		key = (uint64_t) (thread_loads[i].load_pct / 5) << 32 |
+		      thread_loads[i].nr_conns;
+		if (key < best_key) {
+			best = i;
+			best_key = key;
 		}
 	}
 
-	assert(ret == 1);
-
-	return 0;
+	__sync_fetch_and_add(&thread_loads[best].nr_conns, 1);
+	return best;
 }
 
-uint64_t ntohll(uint64_t value)
+/*
+ * Called by the owner right after it ran @conn. Once the conn is in the
+ * target's epoll set the target owns it, so the source must not touch it
+ * again; this is why migration happens here and not from the rebalancer.
+ * Level-triggered epoll reports any data that arrived in between.
+ */
+static void conn_migrate(struct conn *conn)
 {
-	/* really lazy, assumes a specific endianness */
+	struct thread_load *load = &thread_loads[thread_no];
+	struct epoll_event ev;
+	int to = load->migrate_to;
 
-	const uint32_t high_part = ntohl((uint32_t) (value >> 32));
-	const uint32_t low_part = ntohl((uint32_t) (value & 0xFFFFFFFFLL));
+	load->migrate_to = -1;
+	stat_inc(STAT_SYSCALLS);
+	if (epoll_ctl(epollfd[thread_no], EPOLL_CTL_DEL, conn->fd, NULL) == -1) {
+		perror("epoll_ctl: EPOLL_CTL_DEL");
+		exit(EXIT_FAILURE);
+	}
 
-	return (((uint64_t) low_part) << 32) | high_part;
+	__sync_fetch_and_sub(&load->nr_conns, 1);
+	__sync_fetch_and_add(&thread_loads[to].nr_conns, 1);
+	stat_inc(STAT_MIGRATIONS);
+
+	ev.events = EPOLLIN | EPOLLERR;
+	ev.data.ptr = conn;
+	stat_inc(STAT_SYSCALLS);
+	if (epoll_ctl(epollfd[to], EPOLL_CTL_ADD, conn->fd, &ev) == -1) {
+		perror("epoll_ctl: EPOLL_CTL_ADD");
+		exit(EXIT_FAILURE);
+	}
 }
 
-static void drive_machine(struct conn *conn)
+static void *balance_thread_main(void *arg)
 {
-	ssize_t ret;
+	uint64_t last_busy[MAX_THREADS] = { 0 };
+	uint64_t busy, now, last = rdtsc();
+	int i, max, min;
 
-	switch (conn->state) {
-	case STATE_RECEIVE:
-next_request:
-		ret = recv_exactly(conn, &conn->payload, sizeof(conn->payload));
-		if (handle_ret(conn, ret, __LINE__))
-			return;
-		conn->state = STATE_SPIN;
-		/* fallthrough */
-	case STATE_SPIN:
-		do_work(ntohll(conn->payload.work_iterations));
-		conn->state = STATE_SEND;
-		/* fallthrough */
-	case STATE_SEND:
-		ret = send_exactly(conn, &conn->payload, sizeof(conn->payload));
-		if (handle_ret(conn, ret, __LINE__))
-			return;
-		conn->state = STATE_RECEIVE;
-		if (avail_bytes(conn) >= sizeof(conn->payload))
-			goto next_request;
-		break;
-	default:
-		assert(0);
+	while (1) {
+		usleep(balance_interval_ms * 1000);
+		now = rdtsc();
+
+		max = min = 0;
+		for (i = 0; i < nr_cpu; i++) {
+			busy = thread_loads[i].busy_tsc;
+			thread_loads[i].load_pct = (busy - last_busy[i]) * 100 / (now - last);
+			last_busy[i] = busy;
+			if (thread_loads[i].load_pct > thread_loads[max].load_pct)
+				max = i;
+			if (thread_loads[i].load_pct < thread_loads[min].load_pct)
+				min = i;
+		}
+		last = now;
+
+		/* moving a thread's only conn just moves the hot spot */
+		if (thread_loads[max].load_pct - thread_loads[min].load_pct >= balance_threshold &&
+		    thread_loads[max].nr_conns > 1)
+			thread_loads[max].migrate_to = min;
 	}
+
+	return NULL;
+}
+
+static void balance_report(void)
+{
+	int i;
+
+	printf("balance: load%%");
+	for (i = 0; i < nr_cpu; i++)
+		printf(" %d", thread_loads[i].load_pct);
+	printf(" conns");
+	for (i = 0; i < nr_cpu; i++)
+		printf(" %d", thread_loads[i].nr_conns);
+	printf("\n");
+}
+
+/* growth since startup, divided over the open conns */
+static void memory_report(void)
+{
+	long conns, bufs, vm_kb, rss_kb;
+
+	conns = stats_sum(STAT_ACCEPTS) - stats_sum(STAT_CLOSES);
+	bufs = stats_sum(STAT_BUF_ATTACHES) - stats_sum(STAT_BUF_RELEASES);
+	stats_mem_kb(&vm_kb, &rss_kb);
+	printf("memory: conns=%ld bufs=%ld rss=%ldKB", conns, bufs, rss_kb);
+	if (conns > 0)
+		printf(" rss/conn=%.2fKB", (double) (rss_kb - base_rss_kb) / conns);
+	printf("\n");
 }
 
-static void epoll_ctl_add(int fd, void *arg)
+static void pipeline_report(void)
+{
+	printf("pipeline: receive=%d", nr_cpu);
+	stage_report(&work_stage);
+	stage_report(&send_stage);
+	printf("\n");
+}
+
+static void linux_report(double secs)
+{
+	if (dispatch_mode == DISPATCH_BALANCE)
+		balance_report();
+	if (dispatch_mode == DISPATCH_PIPELINE)
+		pipeline_report();
+	if (memory_stats)
+		memory_report();
+}
+
+static always_inline void epoll_ctl_add(int fd, void *arg, const int mode)
 {
 	struct epoll_event ev;
+	int target;
 
 	ev.events = EPOLLIN | EPOLLERR;
-#if CONFIG_USE_EPOLLEXCLUSIVE
-	ev.events |= EPOLLEXCLUSIVE;
-#endif
+	if (mode == DISPATCH_EXCLUSIVE)
+		ev.events |= EPOLLEXCLUSIVE;
+	else if (DISPATCH_ONESHOT_SET(mode))
+		ev.events |= EPOLLONESHOT;
 	ev.data.fd = fd;
 	ev.data.ptr = arg;
-#if CONFIG_REGISTER_FD_TO_ALL_EPOLLS
-	for (int i = 0; i < nr_cpu; i++) {
-		if (epoll_ctl(epollfd[i], EPOLL_CTL_ADD, fd, &ev) == -1) {
-			perror("epoll_ctl: EPOLL_CTL_ADD");
-			exit(EXIT_FAILURE);
+	if (DISPATCH_SHARES_FDS(mode)) {
+		for (int i = 0; i < nr_cpu; i++) {
+			stat_inc(STAT_SYSCALLS);
+			if (epoll_ctl(epollfd[i], EPOLL_CTL_ADD, fd, &ev) == -1) {
+				perror("epoll_ctl: EPOLL_CTL_ADD");
+				exit(EXIT_FAILURE);
+			}
 		}
+		return;
 	}
-#else
-	if (epoll_ctl(epollfd[thread_no], EPOLL_CTL_ADD, fd, &ev) == -1) {
+
+	/* in oneshot mode every thread's slot holds the shared epoll set */
+	target = mode == DISPATCH_BALANCE ? balance_place() : thread_no;
+	stat_inc(STAT_SYSCALLS);
+	if (epoll_ctl(epollfd[target], EPOLL_CTL_ADD, fd, &ev) == -1) {
 		perror("epoll_ctl: EPOLL_CTL_ADD");
 		exit(EXIT_FAILURE);
 	}
-#endif
+}
+
+/* any thread: with EPOLLONESHOT every slot holds the one shared set */
+static void epoll_ctl_rearm(int fd, epoll_data_t data)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLERR | EPOLLONESHOT;
+	ev.data = data;
+	stat_inc(STAT_SYSCALLS);
+	if (epoll_ctl(epollfd[0], EPOLL_CTL_MOD, fd, &ev) == -1) {
+		perror("epoll_ctl: EPOLL_CTL_MOD");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void pipe_init(struct conn *conn)
+{
+	if (!conn->pipe) {
+		conn->pipe = malloc(sizeof(*conn->pipe) * (CONFIG_PIPELINE_DEPTH + 1));
+		if (!conn->pipe) {
+			perror("malloc");
+			exit(1);
+		}
+	}
+	conn->pipe_n = 0;
+	req_init(&conn->pipe[0]);
+}
+
+/*
+ * recv() only runs on an empty buffer, and never for more bytes than the
+ * free pipe slots hold, less the part of a payload already parsed. So a
+ * full hand-off never leaves a complete request in the buffer, where no
+ * epoll event would announce it.
+ */
+static ssize_t pipe_recv(void *arg, void *buf, size_t len)
+{
+	struct conn *conn = arg;
+	int room = (CONFIG_PIPELINE_DEPTH - conn->pipe_n) * sizeof(struct payload) -
+		   conn->pipe[conn->pipe_n].partial;
+
+	return sock_recv(conn->fd, &conn->rx, &rx_pool, room, buf, len);
+}
+
+/* the receive stage only parses; work and reply happen further down */
+static bool pipe_defer(void *arg, struct req_state *st)
+{
+	return false;
+}
+
+static const struct transport pipe_transport = {
+	pipe_recv, linux_send, linux_work, NULL, pipe_defer,
+};
+
+static enum req_status pipe_parse(struct conn *conn)
+{
+	enum req_status status;
+
+	do {
+		status = req_drive(&conn->pipe[conn->pipe_n], conn, &pipe_transport);
+		if (status != REQ_DEFERRED)
+			return status;
+		req_init(&conn->pipe[++conn->pipe_n]);
+	} while (conn->pipe_n < CONFIG_PIPELINE_DEPTH && avail_bytes(conn));
+
+	return status;
+}
+
+static void pipe_receive(struct conn *conn, epoll_data_t data)
+{
+	if (pipe_parse(conn) == REQ_CLOSED) {
+		conn_close(conn);
+		return;
+	}
+	if (lazy_buffers)
+		conn_settle_buf(conn);
+	if (conn->pipe_n)
+		stage_push(&work_stage, conn);
+	else
+		epoll_ctl_rearm(conn->fd, data);
+}
+
+static void pipe_work(void *item)
+{
+	struct conn *conn = item;
+	struct req_state *st;
+	int i;
+
+	for (i = 0; i < conn->pipe_n; i++) {
+		st = &conn->pipe[i];
+		st->start_tsc = rdtsc();
+		run_request(&st->payload);
+		st->end_tsc = rdtsc();
+	}
+	stage_push(&send_stage, conn);
+}
+
+/* a full socket buffer blocks this send thread, never the others */
+static int pipe_send_all(int fd, const unsigned char *buf, size_t len)
+{
+	struct pollfd pfd = { fd, POLLOUT, 0 };
+	ssize_t ret;
+
+	while (len) {
+		stat_inc(STAT_SYSCALLS);
+		ret = send(fd, buf, len, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EAGAIN) {
+			stat_inc(STAT_SYSCALLS);
+			poll(&pfd, 1, -1);
+			continue;
+		}
+		if (ret <= 0)
+			return 0;
+		buf += ret;
+		len -= ret;
+	}
+
+	return 1;
+}
+
+static void pipe_send(void *item)
+{
+	unsigned char out[CONFIG_PIPELINE_DEPTH * sizeof(struct payload_ts)];
+	struct conn *conn = item;
+	struct payload_ts reply;
+	uint64_t now = rdtsc();
+	epoll_data_t data;
+	size_t len = 0, n;
+	int i;
+
+	for (i = 0; i < conn->pipe_n; i++) {
+		conn->pipe[i].send_tsc = now;
+		n = req_reply(&conn->pipe[i], &reply);
+		memcpy(&out[len], &reply, n);
+		len += n;
+	}
+
+	/* the receive stage sees the hangup and closes the conn */
+	if (pipe_send_all(conn->fd, out, len)) {
+		stat_add(STAT_REQUESTS, conn->pipe_n);
+	} else {
+		stat_inc(STAT_SYSCALLS);
+		shutdown(conn->fd, SHUT_RDWR);
+	}
+
+	conn->pipe[0] = conn->pipe[conn->pipe_n];
+	conn->pipe_n = 0;
+	data.ptr = conn;
+	epoll_ctl_rearm(conn->fd, data);
+}
+
+/*
+ * Work and send threads are all started up front. Unless their counts are
+ * fixed, both pools adapt between one thread and nr_cpu.
+ */
+static void start_pipeline(void)
+{
+	struct stage *stages[] = { &work_stage, &send_stage };
+	int adapt = !pipeline_work_threads || !pipeline_send_threads;
+	int work = pipeline_work_threads ? pipeline_work_threads : nr_cpu;
+	int send = pipeline_send_threads ? pipeline_send_threads : nr_cpu;
+
+	stage_init(&work_stage, "work", pipe_work, work, nr_cpu,
+		   pipeline_work_threads ? work : 1);
+	stage_init(&send_stage, "send", pipe_send, send, work,
+		   pipeline_send_threads ? send : 1);
+	work_stage.next = &send_stage;
+	stage_start(&work_stage);
+	stage_start(&send_stage);
+	stage_monitor_start(stages, 2, adapt);
+
+	printf("pipeline: %d receive threads, %s work and send pools\n", nr_cpu,
+	       adapt ? "adaptive" : "fixed");
 }
 
 static void setnonblocking(int fd)
@@ -219,35 +639,210 @@ static void setnonblocking(int fd)
 	assert(flags >= 0);
 }
 
-static int try_lock(struct conn *conn)
+static always_inline int try_lock(struct conn *conn, const int mode)
 {
-#if CONFIG_REGISTER_FD_TO_ALL_EPOLLS
+	if (!DISPATCH_SHARES_FDS(mode))
+		return 1;
+
 	asm volatile("" : : : "memory");
 	int ret = __sync_bool_compare_and_swap(&conn->lock, 0, 1);
 	asm volatile("" : : : "memory");
 	return ret;
-#else
-	return 1;
-#endif
 }
 
-static void unlock(struct conn *conn)
+static always_inline void unlock(struct conn *conn, const int mode)
 {
-#if CONFIG_REGISTER_FD_TO_ALL_EPOLLS
+	if (!DISPATCH_SHARES_FDS(mode))
+		return;
+
 	asm volatile("" : : : "memory");
 	conn->lock = 0;
 	asm volatile("" : : : "memory");
-#endif
 }
 
+/*
+ * New conns start out locked so that no other thread can run (and close)
+ * them before they are registered with every epoll set.
+ */
+static void conn_init(struct conn *conn, int fd)
+{
+	conn->lock = 1;
+	conn->fd = fd;
+	req_init(&conn->req);
+	sock_buf_init(&conn->rx, &rx_pool);
+	if (dispatch_mode == DISPATCH_PIPELINE)
+		pipe_init(conn);
+}
+
+static always_inline void accept_one(int sock, const int mode)
+{
+	struct conn *conn;
+	int conn_sock, one = 1;
+
+	stat_add(STAT_SYSCALLS, 4);	/* accept, 2x fcntl, setsockopt */
+	conn_sock = accept(sock, NULL, NULL);
+	if (conn_sock == -1) {
+		/* the client may have given up before we got to it */
+		if (errno == EAGAIN || errno == ECONNABORTED)
+			return;
+		perror("accept");
+		exit(EXIT_FAILURE);
+	}
+	setnonblocking(conn_sock);
+	if (setsockopt(conn_sock, IPPROTO_TCP, TCP_NODELAY, (void *) &one, sizeof(one))) {
+		perror("setsockopt(TCP_NODELAY)");
+		exit(1);
+	}
+	conn = conn_alloc();
+	conn_init(conn, conn_sock);
+	stat_inc(STAT_ACCEPTS);
+	epoll_ctl_add(conn_sock, conn, mode);
+	unlock(conn, mode);
+}
+
+/*
+ * Churn mode: drain the accept queue in one go. O_NONBLOCK comes from
+ * accept4() and TCP_NODELAY is inherited from the listener, so each new
+ * connection costs one accept4() and one epoll_ctl() (or one per thread
+ * if the dispatch mode shares fds).
+ */
+static always_inline void accept_batch(int sock, const int mode)
+{
+	struct conn *conn;
+	int conn_sock;
+
+	while (1) {
+		stat_inc(STAT_SYSCALLS);
+		conn_sock = accept4(sock, NULL, NULL, SOCK_NONBLOCK);
+		if (conn_sock == -1) {
+			switch (errno) {
+			case EAGAIN:
+				return;
+			case EINTR:
+			case ECONNABORTED:
+				continue;
+			default:
+				perror("accept4");
+				exit(EXIT_FAILURE);
+			}
+		}
+		conn = conn_alloc();
+		conn_init(conn, conn_sock);
+		stat_inc(STAT_ACCEPTS);
+		epoll_ctl_add(conn_sock, conn, mode);
+		unlock(conn, mode);
+	}
+}
+
+/*
+ * Listeners are tagged by a zero low word in their epoll data. In oneshot
+ * mode all listeners share one epoll set, so the fd rides in the high word.
+ */
+static always_inline void event_loop(int sock, const int mode)
+{
+	/* the receive stage batches its hand-offs, so it takes more at once */
+	const int max_events = mode == DISPATCH_PIPELINE ?
+		CONFIG_PIPELINE_EVENTS : CONFIG_MAX_EVENTS;
+	struct epoll_event events[CONFIG_MAX_EVENTS > CONFIG_PIPELINE_EVENTS ?
+				  CONFIG_MAX_EVENTS : CONFIG_PIPELINE_EVENTS];
+	int i, nfds, lsock;
+	struct conn *conn;
+	uint64_t start_tsc = 0;
+
+	while (1) {
+		stat_inc(STAT_SYSCALLS);
+		nfds = epoll_wait(epollfd[thread_no], events, max_events, -1);
+		assert(nfds > 0);
+		for (i = 0; i < nfds; i++) {
+			if (events[i].data.u32 == 0) {
+				lsock = DISPATCH_ONESHOT_SET(mode) ?
+					events[i].data.u64 >> 32 : sock;
+				if (churn_mode)
+					accept_batch(lsock, mode);
+				else
+					accept_one(lsock, mode);
+				if (DISPATCH_ONESHOT_SET(mode))
+					epoll_ctl_rearm(lsock, events[i].data);
+				continue;
+			}
+
+			conn = events[i].data.ptr;
+			if (!try_lock(conn, mode))
+				continue;
+			if (mode == DISPATCH_BALANCE)
+				start_tsc = rdtsc();
+			if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+				conn_close(conn);
+			} else if (mode == DISPATCH_PIPELINE) {
+				/* the conn may already belong to the work stage */
+				pipe_receive(conn, events[i].data);
+				continue;
+			} else {
+				drive_machine(conn);
+			}
+			if (lazy_buffers)
+				conn_settle_buf(conn);
+			if (mode == DISPATCH_ONESHOT && conn->fd >= 0)
+				epoll_ctl_rearm(conn->fd, events[i].data);
+			if (mode == DISPATCH_BALANCE) {
+				thread_loads[thread_no].busy_tsc += rdtsc() - start_tsc;
+				if (thread_loads[thread_no].migrate_to >= 0 && conn->fd >= 0)
+					conn_migrate(conn);
+			}
+			unlock(conn, mode);
+		}
+		if (mode == DISPATCH_PIPELINE)
+			stage_flush(&work_stage);
+		conn_flush_deferred();
+	}
+}
+
+static void event_loop_lock(int sock)
+{
+	event_loop(sock, DISPATCH_LOCK);
+}
+
+static void event_loop_exclusive(int sock)
+{
+	event_loop(sock, DISPATCH_EXCLUSIVE);
+}
+
+static void event_loop_single(int sock)
+{
+	event_loop(sock, DISPATCH_SINGLE);
+}
+
+static void event_loop_oneshot(int sock)
+{
+	event_loop(sock, DISPATCH_ONESHOT);
+}
+
+static void event_loop_balance(int sock)
+{
+	event_loop(sock, DISPATCH_BALANCE);
+}
+
+static void event_loop_pipeline(int sock)
+{
+	event_loop(sock, DISPATCH_PIPELINE);
+}
+
+static void (*const event_loops[NR_DISPATCH_MODES])(int sock) = {
+	[DISPATCH_LOCK]		= event_loop_lock,
+	[DISPATCH_EXCLUSIVE]	= event_loop_exclusive,
+	[DISPATCH_SINGLE]	= event_loop_single,
+	[DISPATCH_ONESHOT]	= event_loop_oneshot,
+	[DISPATCH_BALANCE]	= event_loop_balance,
+	[DISPATCH_PIPELINE]	= event_loop_pipeline,
+};
+
 static void *tcp_thread_main(void *arg)
 {
 	struct sockaddr_in sin;
 	int sock;
 	int one;
-	int ret, i, nfds, conn_sock;
-	struct epoll_event ev, events[CONFIG_MAX_EVENTS];
-	struct conn *conn;
+	int ret;
+	struct epoll_event ev;
 
 	sock = socket(AF_INET, SOCK_STREAM, 0);
 	if (!sock) {
@@ -279,6 +874,13 @@ static void *tcp_thread_main(void *arg)
 		exit(1);
 	}
 
+	one = 1;
+	if (churn_mode &&
+	    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *) &one, sizeof(one))) {
+		perror("setsockopt(TCP_NODELAY)");
+		exit(1);
+	}
+
 	if (listen(sock, BACKLOG)) {
 		perror("listen");
 		exit(1);
@@ -288,56 +890,138 @@ static void *tcp_thread_main(void *arg)
 
 	init_thread();
 
-	epollfd[thread_no] = epoll_create1(0);
 	ev.events = EPOLLIN;
-	ev.data.u32 = 0;
+	ev.data.u64 = 0;
+	if (DISPATCH_ONESHOT_SET(dispatch_mode)) {
+		ev.events |= EPOLLONESHOT;
+		ev.data.u64 = (uint64_t) sock << 32;
+	}
 	ret = epoll_ctl(epollfd[thread_no], EPOLL_CTL_ADD, sock, &ev);
 	assert(!ret);
 
+	event_loops[dispatch_mode](sock);
+
+	return NULL;
+}
+
+static int shm_thread_idle(void)
+{
+	int i;
+
+	for (i = thread_no; i < shm_channels; i += nr_cpu)
+		if (!shm_ring_empty(&shm_region->channels[i].req))
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Shared-memory transport: thread i serves every nr_cpu-th channel,
+ * spinning for a while before it goes to sleep on its doorbell.
+ */
+static void *shm_thread_main(void *arg)
+{
+	struct shm_doorbell *bell;
+	struct shm_channel *ch;
+	struct payload payload;
+	struct payload_ts reply;
+	uint64_t recv_tsc, start_tsc, end_tsc, pass_tsc;
+	const void *msg;
+	int i, busy, idle = 0;
+	uint32_t seq, len;
+
+	thread_no = (long) arg;
+	bell = &shm_region->server_bells[thread_no];
+
+	init_thread();
+
 	while (1) {
-		nfds = epoll_wait(epollfd[thread_no], events, CONFIG_MAX_EVENTS, -1);
-		assert(nfds > 0);
-		for (i = 0; i < nfds; i++) {
-			if (events[i].data.u32 == 0) {
-				conn_sock = accept(sock, NULL, NULL);
-				if (conn_sock == -1) {
-					perror("accept");
-					exit(EXIT_FAILURE);
-				}
-				setnonblocking(conn_sock);
-				if (setsockopt(conn_sock, IPPROTO_TCP, TCP_NODELAY, (void *) &one, sizeof(one))) {
-					perror("setsockopt(TCP_NODELAY)");
-					exit(1);
-				}
-				conn = malloc(sizeof *conn);
-#if CONFIG_REGISTER_FD_TO_ALL_EPOLLS
-				conn->lock = 0;
-#endif
-				conn->fd = conn_sock;
-				conn->state = STATE_RECEIVE;
-				conn->buf_head = 0;
-				conn->buf_tail = 0;
-				epoll_ctl_add(conn_sock, conn);
-			} else {
-				conn = events[i].data.ptr;
-				if (events[i].events & (EPOLLHUP | EPOLLERR)) {
-					close(conn->fd);
-					/* TODO: should also free conn */
-				} else {
-					if (try_lock(conn)) {
-						drive_machine(conn);
-						unlock(conn);
-					}
+		busy = 0;
+		pass_tsc = rdtsc();
+		for (i = thread_no; i < shm_channels; i += nr_cpu) {
+			ch = &shm_region->channels[i];
+			while (shm_ring_pop(&ch->req, &payload, sizeof(payload))) {
+				recv_tsc = start_tsc = rdtsc();
+				run_request(&payload);
+				end_tsc = rdtsc();
+				msg = &payload;
+				len = sizeof(payload);
+				if (proto_flags(&payload) & PROTO_FLAG_TIMESTAMPS) {
+					payload_ts_fill(&reply, &payload, tsc_to_ns(recv_tsc),
+							tsc_to_ns(start_tsc), tsc_to_ns(end_tsc),
+							tsc_to_ns(rdtsc()));
+					msg = &reply;
+					len = sizeof(reply);
 				}
+				while (!shm_ring_push(&ch->resp, msg, len))
+					asm volatile("pause");
+				shm_bell_ring(&ch->client_bell);
+				stat_inc(STAT_REQUESTS);
+				busy = 1;
 			}
 		}
+
+		if (busy) {
+			idle = 0;
+			continue;
+		}
+		stat_add(STAT_SPIN_CYCLES, rdtsc() - pass_tsc);
+		if (++idle < SHM_SPIN_ROUNDS)
+			continue;
+
+		seq = shm_bell_prepare(bell);
+		if (shm_thread_idle()) {
+			stat_inc(STAT_SYSCALLS);
+			shm_bell_wait(bell, seq);
+		} else {
+			shm_bell_cancel(bell);
+		}
+		idle = 0;
 	}
 
 	return NULL;
 }
 
+static void start_shm_server(void)
+{
+	int i;
+	pthread_t tid;
+
+	shm_region = shm_region_create(shm_name, shm_channels, nr_cpu);
+
+	printf("starting linux shm server with %d threads, region %s, %d channels\n",
+	       nr_cpu, shm_name, shm_channels);
+	fflush(stdout);
+	if (cpu_stats)
+		stats_start(1000);
+	for (i = 1; i < nr_cpu; i++) {
+		if (pthread_create(&tid, NULL, shm_thread_main, (void *) (long) i)) {
+			fprintf(stderr, "failed to spawn thread %d\n", i);
+			exit(-1);
+		}
+	}
+
+	shm_thread_main(0);
+}
+
+int set_dispatch_mode(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NR_DISPATCH_MODES; i++) {
+		if (!strcmp(name, dispatch_names[i])) {
+			dispatch_mode = i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
 void init_linux(int n_cpu, int port)
 {
+	struct rlimit rl;
+
 	srand48(mytime());
 
 	/*	cpu_set_t cpuset;
@@ -346,16 +1030,90 @@ void init_linux(int n_cpu, int port)
 	nr_cpu = CPU_COUNT(&cpuset);*/
 	nr_cpu = n_cpu;
 
+	/* idle-connection runs need far more fds than the default soft limit */
+	if (!getrlimit(RLIMIT_NOFILE, &rl)) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
 	listen_port = port;
+	tsc_calibrate();
+}
+
+static int nr_server_cores(void)
+{
+	return nr_cpu;
 }
 
 void start_linux_server(void)
 {
 	int i;
 	pthread_t tid;
+	long vm_kb;
+
+	if (nr_cpu < 1 || nr_cpu > MAX_THREADS) {
+		fprintf(stderr, "invalid thread count %d\n", nr_cpu);
+		exit(-1);
+	}
+
+	if (cpu_stats)
+		stats_cpu_accounting(nr_server_cores);
+
+	/* helpers compete with the server threads for cores */
+	if (split_ways > 1)
+		fj_init(split_ways - 1);
+	if (block_mode == BLOCK_BACKEND)
+		backend_start();
+
+	if (shm_name) {
+		start_shm_server();
+		return;
+	}
 
-	printf("starting linux server with %d threads, port %d\n", nr_cpu, listen_port);
+	/* short-lived conns are cheaper to keep on the accepting thread */
+	if (dispatch_mode < 0)
+		dispatch_mode = churn_mode ? DISPATCH_SINGLE : DEFAULT_DISPATCH;
+
+	/* all sets must exist before any thread registers a conn */
+	for (i = 0; i < nr_cpu; i++) {
+		if (DISPATCH_ONESHOT_SET(dispatch_mode) && i > 0)
+			epollfd[i] = epollfd[0];
+		else
+			epollfd[i] = epoll_create1(0);
+		if (epollfd[i] < 0) {
+			perror("epoll_create1");
+			exit(-1);
+		}
+	}
+
+	printf("starting linux server with %d threads, port %d, %s dispatch%s\n",
+	       nr_cpu, listen_port, dispatch_names[dispatch_mode],
+	       churn_mode ? " (churn mode)" : "");
+	if (split_ways > 1)
+		printf("splitting requests of %lu+ iterations %d ways\n",
+		       split_threshold, split_ways);
+	if (alloc_strategy != ALLOC_NONE)
+		printf("allocating %d nodes of %d-%d bytes per request with %s\n",
+		       alloc_nodes, alloc_min_size, alloc_max_size, alloc_name());
 	fflush(stdout);
+	if (dispatch_mode == DISPATCH_PIPELINE)
+		start_pipeline();
+	if (dispatch_mode == DISPATCH_BALANCE) {
+		for (i = 0; i < nr_cpu; i++)
+			thread_loads[i].migrate_to = -1;
+		if (pthread_create(&tid, NULL, balance_thread_main, NULL)) {
+			fprintf(stderr, "failed to spawn rebalancer\n");
+			exit(-1);
+		}
+	}
+	if (churn_mode || dispatch_mode == DISPATCH_BALANCE ||
+	    dispatch_mode == DISPATCH_PIPELINE || split_ways > 1 ||
+	    alloc_strategy != ALLOC_NONE ||
+	    memory_stats || cpu_stats) {
+		stats_mem_kb(&vm_kb, &base_rss_kb);
+		stats_set_reporter(linux_report);
+		stats_start(1000);
+	}
 	for (i = 1; i < nr_cpu; i++) {
 		if (pthread_create(&tid, NULL, tcp_thread_main, (void *) (long) i)) {
 			fprintf(stderr, "failed to spawn thread %d\n", i);
@@ -3,6 +3,7 @@
 #include <math.h>
 #include <stdint.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #if defined (__cplusplus)
@@ -16,8 +17,14 @@ void init_thread(void);
 void process_request(void);
 void start_ix_server(int udp);
 void start_linux_server(void);
+int set_dispatch_mode(const char *name);
+void init_linux_threads(int port, int pool_size, size_t stack_kb);
+void start_linux_threads_server(void);
+void init_coro(int n_cpu, int port);
+void start_coro_server(void);
 void start_arachne_server(int udp, int port);
 void do_work(int iterations);
+void tsc_calibrate(void);
 
 #if defined (__cplusplus)
 }
@@ -25,6 +32,48 @@ void do_work(int iterations);
 
 extern __thread int thread_no;
 extern int nr_cpu;
+extern int churn_mode;
+extern const char *shm_name;
+extern int shm_channels;
+extern int coro_steal;
+extern int balance_interval_ms;
+extern int balance_threshold;
+
+/* requests of at least split_threshold iterations run in split_ways parts */
+#define MAX_SPLIT_WAYS 64
+extern uint64_t split_threshold;
+extern int split_ways;
+extern int lazy_buffers;
+/* fixed pool sizes for pipeline dispatch, 0 to adapt */
+extern int pipeline_work_threads;
+extern int pipeline_send_threads;
+extern int memory_stats;
+extern int cpu_stats;
+extern int nr_dispatchers;
+extern int persistent_threads;
+extern int udp_batch;
+
+/* how the blocking phase of a PROTO_FLAG_BLOCKING request blocks */
+enum block_mode {
+	BLOCK_SLEEP,		/* sleep for the requested time */
+	BLOCK_BACKEND,		/* call the mock backend, see backend.h */
+};
+extern int block_mode;
+
+/* what a dispatcher does with new work once its pending queue is full */
+enum overflow_policy {
+	OVERFLOW_STOP,		/* stop reading until the queue drains */
+	OVERFLOW_DROP,		/* close the conn, or discard the datagrams */
+	OVERFLOW_REJECT,	/* reply with PROTO_FLAG_REJECTED */
+};
+extern int pending_limit;
+
+/* dispatchers run shorter requests themselves; see inline_ok() */
+extern uint64_t inline_threshold;
+extern int inline_auto;
+extern int overflow_policy;
+/* set by --queue and --overflow to print the admission counters */
+extern int admission_stats;
 
 static inline long mytime(void)
 {
@@ -32,3 +81,24 @@ static inline long mytime(void)
 	gettimeofday(&tv, NULL);
 	return tv.tv_sec * 1000000 + tv.tv_usec;
 }
+
+static inline uint64_t rdtsc(void)
+{
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t) hi << 32) | lo;
+}
+
+extern double cycles_per_ns;
+
+static inline uint64_t tsc_to_ns(uint64_t tsc)
+{
+	return tsc / cycles_per_ns;
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
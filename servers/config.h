@@ -2,7 +2,36 @@
 
 #define CONFIG_MAX_EVENTS 1
 
+/*
+ * These two pick the default dispatch strategy of the Linux server;
+ * --dispatch overrides it at runtime.
+ */
+
 /* TODO: should specify a number of threads to declare each fd */
 #define CONFIG_REGISTER_FD_TO_ALL_EPOLLS 1
 
 #define CONFIG_USE_EPOLLEXCLUSIVE 1
+
+/*
+ * Balance dispatch: how often the rebalancer samples thread load, and how
+ * many percentage points apart the busiest and idlest thread must be
+ * before a conn is migrated.
+ */
+#define CONFIG_BALANCE_INTERVAL_MS 100
+#define CONFIG_BALANCE_THRESHOLD 20
+
+/*
+ * Pipeline dispatch: requests per conn handed between stages at a time,
+ * events per epoll_wait() in the receive stage, and how often the work
+ * and send pools are resized. A stage gets another thread once its mean
+ * backlog exceeds CONFIG_PIPELINE_GROW items per thread. It gives one back
+ * after CONFIG_PIPELINE_CALM intervals in which its load, in busy threads,
+ * would have kept one thread fewer below CONFIG_PIPELINE_SHRINK_LOAD
+ * percent.
+ */
+#define CONFIG_PIPELINE_DEPTH 16
+#define CONFIG_PIPELINE_EVENTS 64
+#define CONFIG_PIPELINE_INTERVAL_MS 100
+#define CONFIG_PIPELINE_GROW 4
+#define CONFIG_PIPELINE_CALM 10
+#define CONFIG_PIPELINE_SHRINK_LOAD 50
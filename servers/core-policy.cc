@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Arachne/Arachne.h"
+#include "Arachne/DefaultCorePolicy.h"
+#include "common.h"
+#include "core-policy.h"
+
+struct core_policy_params core_policy = {
+	0, CORE_POLICY_PERCENTILE, CORE_POLICY_INTERVAL_MS, CORE_POLICY_RELEASE,
+	CORE_POLICY_CALM
+};
+uint64_t delay_hist[DELAY_BUCKETS];
+
+/*
+ * DefaultCorePolicy still decides which core each thread class runs on;
+ * once started, only its utilization-based estimator is replaced.
+ */
+class QueueDelayCorePolicy : public Arachne::DefaultCorePolicy {
+  public:
+	explicit QueueDelayCorePolicy(int max_cores)
+		: Arachne::DefaultCorePolicy(max_cores), calm(0) {}
+
+	/*
+	 * One step per interval; Arachne applies the change asynchronously.
+	 * Cores are granted as soon as the target is missed but only given
+	 * back after calm_intervals quiet intervals, so short lulls between
+	 * bursts do not make the count flap.
+	 */
+	void adjust(uint64_t delay_ns)
+	{
+		uint64_t target_ns = core_policy.target_us * 1000;
+		int cores = Arachne::numActiveCores;
+
+		if (delay_ns < core_policy.release * target_ns)
+			calm++;
+		else
+			calm = 0;
+
+		if (delay_ns > target_ns && cores < (int) Arachne::maxNumCores) {
+			printf("core-policy: grant core %d -> %d, p%g queueing %.1f us > %lu us\n",
+			       cores, cores + 1, core_policy.percentile * 100,
+			       delay_ns / 1000.0, core_policy.target_us);
+			Arachne::incrementCoreCount();
+		} else if (calm >= core_policy.calm_intervals &&
+			   cores > (int) Arachne::minNumCores) {
+			calm = 0;
+			printf("core-policy: release core %d -> %d, p%g queueing %.1f us < %.1f us\n",
+			       cores, cores - 1, core_policy.percentile * 100,
+			       delay_ns / 1000.0,
+			       core_policy.release * core_policy.target_us);
+			Arachne::decrementCoreCount();
+		}
+		fflush(stdout);
+	}
+
+  private:
+	int calm;
+};
+
+static QueueDelayCorePolicy *policy;
+
+/* smallest delay in ns that falls into bucket @b */
+static uint64_t bucket_floor(int b)
+{
+	int msb;
+
+	if (b < 8)
+		return b;
+	msb = b / 8 + 2;
+	return (uint64_t) (8 + b % 8) << (msb - 3);
+}
+
+/* upper bound of the bucket holding the p-th percentile, 0 if idle */
+static uint64_t delay_percentile(const uint64_t *counts, double p)
+{
+	uint64_t total = 0, seen = 0;
+	int b;
+
+	for (b = 0; b < DELAY_BUCKETS; b++)
+		total += counts[b];
+	if (!total)
+		return 0;
+
+	for (b = 0; b < DELAY_BUCKETS - 1; b++) {
+		seen += counts[b];
+		if (seen >= p * total)
+			break;
+	}
+
+	return bucket_floor(b + 1);
+}
+
+static void core_policy_main(void)
+{
+	uint64_t last[DELAY_BUCKETS], cur[DELAY_BUCKETS], delta[DELAY_BUCKETS];
+	int b;
+
+	memcpy(last, delay_hist, sizeof(last));
+	while (1) {
+		Arachne::sleep(core_policy.interval_ms * 1000000ull);
+		for (b = 0; b < DELAY_BUCKETS; b++) {
+			cur[b] = __atomic_load_n(&delay_hist[b], __ATOMIC_RELAXED);
+			delta[b] = cur[b] - last[b];
+		}
+		memcpy(last, cur, sizeof(last));
+		policy->adjust(delay_percentile(delta, core_policy.percentile));
+	}
+}
+
+/* value of --@name in @argv, either "--name V" or "--name=V" */
+static const char *arg_value(int argc, const char **argv, const char *name)
+{
+	size_t len = strlen(name);
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--", 2) || strncmp(argv[i] + 2, name, len))
+			continue;
+		if (argv[i][len + 2] == '=')
+			return argv[i] + len + 3;
+		if (!argv[i][len + 2] && i + 1 < argc)
+			return argv[i + 1];
+	}
+	return NULL;
+}
+
+/*
+ * Must run before Arachne::init(), which otherwise installs its own, so
+ * neither our options nor Arachne's have been parsed yet: look for --slo
+ * and --maxNumCores by hand. Without --slo Arachne keeps its own policy.
+ */
+void core_policy_install(int argc, const char **argv)
+{
+	const char *max_cores;
+
+	if (!arg_value(argc, argv, "slo"))
+		return;
+	max_cores = arg_value(argc, argv, "maxNumCores");
+	policy = new QueueDelayCorePolicy(max_cores ? atoi(max_cores) :
+					  sysconf(_SC_NPROCESSORS_CONF));
+	Arachne::setCorePolicy(policy);
+}
+
+void core_policy_start(void)
+{
+	if (!core_policy.target_us || !policy)
+		return;
+
+	policy->disableLoadEstimation();
+	printf("core-policy: target p%g queueing %lu us, every %d ms\n",
+	       core_policy.percentile * 100, core_policy.target_us,
+	       core_policy.interval_ms);
+	if (Arachne::createThread(core_policy_main) == Arachne::NullThread) {
+		fprintf(stderr, "failed to spawn core policy thread\n");
+		exit(-1);
+	}
+}
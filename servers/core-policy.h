@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Queueing-delay core policy for spin-arachne. Workers record how long
+ * each request waited between the dispatcher noticing it and its work
+ * starting; every interval a controller thread compares a percentile of
+ * those delays against a target and asks Arachne for one core more or,
+ * after a calm stretch, one core less. Thread placement is left to
+ * DefaultCorePolicy.
+ */
+
+#define CORE_POLICY_PERCENTILE 0.99
+#define CORE_POLICY_INTERVAL_MS 10
+#define CORE_POLICY_RELEASE 0.5	/* release below this fraction of the target */
+#define CORE_POLICY_CALM 10	/* ...for this many intervals in a row */
+
+/* log-linear buckets: 8 per power of two of nanoseconds */
+#define DELAY_BUCKETS 512
+
+struct core_policy_params {
+	uint64_t target_us;	/* 0 leaves DefaultCorePolicy's estimator on */
+	double percentile;
+	int interval_ms;
+	double release;
+	int calm_intervals;
+};
+
+extern struct core_policy_params core_policy;
+extern uint64_t delay_hist[DELAY_BUCKETS];
+
+void core_policy_install(int argc, const char **argv);
+void core_policy_start(void);
+
+static inline int delay_bucket(uint64_t ns)
+{
+	int msb;
+
+	if (ns < 8)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - 2) * 8 + ((ns >> (msb - 3)) & 7);
+}
+
+/* @queue_tsc: cycles between the dispatcher's notice and the work start */
+static inline void core_policy_record(uint64_t queue_tsc)
+{
+	extern double cycles_per_ns;
+
+	if (!core_policy.target_us)
+		return;
+	__atomic_fetch_add(&delay_hist[delay_bucket(queue_tsc / cycles_per_ns)],
+			   1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,30 @@
+#!/bin/sh
+#
+# Sweep the Linux server's dispatch strategies over several thread counts
+# and print one CSV row per run. Runs server and client on this machine.
+# MODES defaults to every strategy spin-linux knows; keep it in step with
+# --dispatch.
+#
+# Usage: ./dispatch-sweep.sh [worker] [work_iterations] [client_threads]
+
+WORKER=${1:-sqrt}
+WORK=${2:-0}
+CLIENTS=${3:-32}
+PORT=${PORT:-5000}
+DURATION=${DURATION:-10}
+THREADS=${THREADS:-"1 2 4 8 16"}
+MODES=${MODES:-"lock exclusive single oneshot balance pipeline"}
+
+echo "dispatch,threads,requests,secs,rps,p50,p90,p99,p99.9,max"
+for mode in $MODES; do
+	for threads in $THREADS; do
+		./spin-linux --dispatch $mode $WORKER $threads $PORT > /dev/null &
+		server=$!
+		sleep 1
+		printf "%s,%s," $mode $threads
+		./spin-client --csv --threads $CLIENTS --duration $DURATION \
+			--work $WORK 127.0.0.1 $PORT
+		kill $server
+		wait $server 2> /dev/null
+	done
+done
@@ -0,0 +1,114 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "forkjoin.h"
+#include "stats.h"
+
+struct fj_part {
+	uint64_t iterations;
+	volatile int *remaining;
+	struct fj_part *next;
+};
+
+static struct fj_part *fj_head;
+static pthread_mutex_t fj_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fj_cond = PTHREAD_COND_INITIALIZER;
+
+static void fj_work(uint64_t iterations)
+{
+	uint64_t start_tsc = rdtsc();
+
+	do_work(iterations);
+	stat_add(STAT_WORK_CYCLES, rdtsc() - start_tsc);
+}
+
+static void fj_part_run(struct fj_part *part)
+{
+	volatile int *remaining = part->remaining;
+
+	fj_work(part->iterations);
+	/* the owner may return (and free @part) as soon as this hits zero */
+	__sync_fetch_and_sub(remaining, 1);
+}
+
+static struct fj_part *fj_pop(void)
+{
+	struct fj_part *part = fj_head;
+
+	if (part)
+		fj_head = part->next;
+	return part;
+}
+
+static void *fj_helper_main(void *arg)
+{
+	struct fj_part *part;
+
+	init_thread();
+
+	while (1) {
+		pthread_mutex_lock(&fj_lock);
+		while (!fj_head)
+			pthread_cond_wait(&fj_cond, &fj_lock);
+		part = fj_pop();
+		pthread_mutex_unlock(&fj_lock);
+
+		fj_part_run(part);
+	}
+
+	return NULL;
+}
+
+void fj_init(int nr_helpers)
+{
+	pthread_t tid;
+	int i;
+
+	for (i = 0; i < nr_helpers; i++) {
+		if (pthread_create(&tid, NULL, fj_helper_main, NULL)) {
+			fprintf(stderr, "failed to spawn fork-join helper %d\n", i);
+			exit(-1);
+		}
+		pthread_detach(tid);
+	}
+}
+
+void fj_run(uint64_t iterations, int ways)
+{
+	struct fj_part parts[MAX_SPLIT_WAYS], *part;
+	volatile int remaining = ways - 1;
+	uint64_t each = iterations / ways, spin_tsc;
+	int i;
+
+	pthread_mutex_lock(&fj_lock);
+	for (i = 1; i < ways; i++) {
+		parts[i].iterations = each;
+		parts[i].remaining = &remaining;
+		parts[i].next = fj_head;
+		fj_head = &parts[i];
+	}
+	pthread_cond_broadcast(&fj_cond);
+	pthread_mutex_unlock(&fj_lock);
+
+	/* our own share absorbs the rounding */
+	fj_work(iterations - each * (ways - 1));
+
+	/*
+	 * Rather than idle while helpers are busy elsewhere, run queued
+	 * parts ourselves, including parts of other threads' requests.
+	 */
+	while (remaining) {
+		pthread_mutex_lock(&fj_lock);
+		part = fj_pop();
+		pthread_mutex_unlock(&fj_lock);
+		if (part) {
+			fj_part_run(part);
+		} else {
+			spin_tsc = rdtsc();
+			asm volatile("pause");
+			stat_add(STAT_SPIN_CYCLES, rdtsc() - spin_tsc);
+		}
+	}
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Fork-join helper pool for the Linux servers. A long request is cut into
+ * equal parts; the requesting thread runs one of them and then helps drain
+ * the shared queue until every part of its own request is done.
+ */
+
+#if defined (__cplusplus)
+extern "C" {
+#endif
+
+void fj_init(int nr_helpers);
+void fj_run(uint64_t iterations, int ways);
+
+#if defined (__cplusplus)
+}
+#endif
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <endian.h>
+#include <stdint.h>
+
+/*
+ * The spin protocol: a request is a struct payload, and the reply echoes
+ * it once the requested amount of work is done. Both fields are sent in
+ * network byte order.
+ */
+struct payload {
+	uint64_t work_iterations;
+	uint64_t index;
+};
+
+/*
+ * Clients may set flags in the most significant byte of index; servers
+ * that do not know a flag just echo it back. Plain requests keep the
+ * 16-byte format.
+ */
+#define PROTO_FLAG_TIMESTAMPS	0x80	/* reply with a struct payload_ts */
+#define PROTO_FLAG_REJECTED	0x40	/* reply only: shed under overload,
+					   the work was not done */
+#define PROTO_FLAG_BLOCKING	0x20	/* blocks halfway through the work,
+					   see proto_block_us() */
+
+/*
+ * Extended reply carrying server-side timestamps, in nanoseconds and
+ * network byte order. Only differences between them are meaningful:
+ * start - recv is queueing, end - start is service time and send - recv
+ * is the total time spent in the server.
+ */
+struct payload_ts {
+	struct payload payload;
+	uint64_t recv_ns;
+	uint64_t start_ns;
+	uint64_t end_ns;
+	uint64_t send_ns;
+};
+
+static inline uint64_t ntohll(uint64_t value)
+{
+	return be64toh(value);
+}
+
+static inline uint8_t proto_flags(const struct payload *p)
+{
+	return ((const uint8_t *) &p->index)[0];
+}
+
+static inline void proto_set_flags(struct payload *p, uint8_t flags)
+{
+	((uint8_t *) &p->index)[0] |= flags;
+}
+
+/*
+ * A blocking request does half of its iterations, blocks and then does
+ * the rest. The top 32 bits of work_iterations give the time to block in
+ * microseconds, so unlike the other flags this one must only be sent to
+ * servers that know it.
+ */
+static inline uint64_t proto_iterations(const struct payload *p)
+{
+	uint64_t iterations = ntohll(p->work_iterations);
+
+	if (proto_flags(p) & PROTO_FLAG_BLOCKING)
+		iterations &= 0xffffffff;
+	return iterations;
+}
+
+static inline uint32_t proto_block_us(const struct payload *p)
+{
+	if (!(proto_flags(p) & PROTO_FLAG_BLOCKING))
+		return 0;
+	return ntohll(p->work_iterations) >> 32;
+}
+
+static inline void payload_ts_fill(struct payload_ts *r, const struct payload *p,
+				   uint64_t recv_ns, uint64_t start_ns,
+				   uint64_t end_ns, uint64_t send_ns)
+{
+	r->payload = *p;
+	r->recv_ns = htobe64(recv_ns);
+	r->start_ns = htobe64(start_ns);
+	r->end_ns = htobe64(end_ns);
+	r->send_ns = htobe64(send_ns);
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "proto.h"
+#include "stats.h"
+
+#define always_inline inline __attribute__((always_inline))
+
+/*
+ * The spin request state machine, shared by the stream servers. Each
+ * backend describes its transport in a static const struct transport and
+ * passes it to req_drive(). As req_drive() is always inlined, every op is
+ * known at compile time: each call site becomes its own specialized copy
+ * with direct calls, just like the per-mode event loops in common-linux.c.
+ */
+
+enum req_phase {
+	REQ_RECEIVE,
+	REQ_SPIN,
+	REQ_SEND,
+};
+
+/* why req_drive() returned */
+enum req_status {
+	REQ_WANT_RECV,		/* out of input */
+	REQ_WANT_SEND,		/* the reply is partly sent */
+	REQ_DEFERRED,		/* admit() said no; the request waits in REQ_SPIN */
+	REQ_CLOSED,		/* EOF or error; the backend closes the conn */
+};
+
+struct req_state {
+	enum req_phase phase;
+	int partial;		/* bytes of the payload or reply done so far */
+	struct payload payload;
+	uint64_t recv_tsc;	/* preset by a dispatcher, else on completion */
+	uint64_t start_tsc;
+	uint64_t end_tsc;
+	uint64_t send_tsc;
+};
+
+/*
+ * recv and send return the number of bytes moved, 0 on EOF or -errno;
+ * -EAGAIN means the transport would block. more and admit may be NULL.
+ */
+struct transport {
+	ssize_t (*recv)(void *conn, void *buf, size_t len);
+	ssize_t (*send)(void *conn, const void *buf, size_t len);
+	/* does the work, or marks the payload PROTO_FLAG_REJECTED instead */
+	void (*work)(void *conn, struct req_state *st);
+	/* after a reply: go on with the next request right away? */
+	bool (*more)(void *conn);
+	/* run this request now, or leave it for later? */
+	bool (*admit)(void *conn, struct req_state *st);
+};
+
+static inline void req_init(struct req_state *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->phase = REQ_RECEIVE;
+}
+
+/* rebuilt for every send attempt, so it only depends on @st */
+static inline size_t req_reply(const struct req_state *st,
+			       struct payload_ts *reply)
+{
+	if (!(proto_flags(&st->payload) & PROTO_FLAG_TIMESTAMPS)) {
+		reply->payload = st->payload;
+		return sizeof(reply->payload);
+	}
+
+	payload_ts_fill(reply, &st->payload, tsc_to_ns(st->recv_tsc),
+			tsc_to_ns(st->start_tsc), tsc_to_ns(st->end_tsc),
+			tsc_to_ns(st->send_tsc));
+	return sizeof(*reply);
+}
+
+static always_inline enum req_status req_error(ssize_t ret,
+					       enum req_status blocked)
+{
+	/* EBADF: another thread already closed the conn under us */
+	if (ret == -EAGAIN || ret == -EWOULDBLOCK || ret == -EBADF)
+		return blocked;
+	if (ret < 0 && ret != -EPIPE && ret != -ECONNRESET && ret != -EIO)
+		fprintf(stderr, "Unexpected errno %d\n", (int) -ret);
+	return REQ_CLOSED;
+}
+
+/*
+ * Receives, runs and answers requests until the transport blocks, the
+ * conn closes or admit() defers one. Partial payloads and replies are
+ * remembered in @st, so the next call picks up where this one stopped.
+ */
+static always_inline enum req_status
+req_drive(struct req_state *st, void *conn, const struct transport *t)
+{
+	struct payload_ts reply;
+	size_t len;
+	ssize_t ret;
+
+	switch (st->phase) {
+	case REQ_RECEIVE:
+next_request:
+		while (st->partial < (int) sizeof(st->payload)) {
+			ret = t->recv(conn, (char *) &st->payload + st->partial,
+				      sizeof(st->payload) - st->partial);
+			if (ret <= 0) {
+				/* a dispatcher's stamp is stale if nothing came */
+				if (!st->partial)
+					st->recv_tsc = 0;
+				return req_error(ret, REQ_WANT_RECV);
+			}
+			st->partial += ret;
+		}
+		st->partial = 0;
+		if (!st->recv_tsc)
+			st->recv_tsc = rdtsc();
+		st->phase = REQ_SPIN;
+		/* fallthrough */
+	case REQ_SPIN:
+		if (t->admit && !t->admit(conn, st))
+			return REQ_DEFERRED;
+		st->start_tsc = rdtsc();
+		t->work(conn, st);
+		st->end_tsc = rdtsc();
+		st->send_tsc = 0;
+		st->phase = REQ_SEND;
+		/* fallthrough */
+	case REQ_SEND:
+		if (!st->send_tsc)
+			st->send_tsc = rdtsc();
+		len = req_reply(st, &reply);
+		while (st->partial < (int) len) {
+			ret = t->send(conn, (char *) &reply + st->partial,
+				      len - st->partial);
+			if (ret <= 0)
+				return req_error(ret, REQ_WANT_SEND);
+			st->partial += ret;
+		}
+		st->partial = 0;
+		st->recv_tsc = 0;
+		st->phase = REQ_RECEIVE;
+		stat_inc(proto_flags(&st->payload) & PROTO_FLAG_REJECTED ?
+			 STAT_REJECTS : STAT_REQUESTS);
+		if (t->more && !t->more(conn))
+			return REQ_WANT_RECV;
+		goto next_request;
+	}
+
+	return REQ_CLOSED;
+}
+
+/*
+ * For socket transports that read through a per-conn buffer, so that one
+ * recv() picks up several pipelined requests: copies out buffered bytes,
+ * refilling the buffer from @fd once it is empty.
+ */
+static always_inline ssize_t req_buf_recv(int fd, unsigned char *buf, int size,
+					  int *head, int *tail, void *dst,
+					  size_t len)
+{
+	ssize_t ret;
+
+	if (*head == *tail) {
+		*head = *tail = 0;
+		stat_inc(STAT_SYSCALLS);
+		ret = recv(fd, buf, size, 0);
+		if (ret <= 0)
+			return ret < 0 ? -errno : 0;
+		*tail = ret;
+	}
+
+	if (len > (size_t) (*tail - *head))
+		len = *tail - *head;
+	memcpy(dst, &buf[*head], len);
+	*head += len;
+
+	return len;
+}
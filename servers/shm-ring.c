@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "shm-ring.h"
+
+#define SHM_DEFAULT_CHANNELS 64
+
+static size_t shm_region_size(int nr_channels)
+{
+	return sizeof(struct shm_region) +
+	       nr_channels * sizeof(struct shm_channel);
+}
+
+struct shm_region *shm_region_create(const char *name, int nr_channels,
+				     int nr_server_bells)
+{
+	struct shm_region *r;
+	size_t size;
+	int fd;
+
+	if (nr_channels < 1 || nr_server_bells < 1 ||
+	    nr_server_bells > SHM_MAX_SERVER_BELLS) {
+		fprintf(stderr, "shm: invalid channel or doorbell count\n");
+		exit(1);
+	}
+
+	size = shm_region_size(nr_channels);
+	shm_unlink(name);
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0666);
+	if (fd < 0) {
+		perror("shm_open");
+		exit(1);
+	}
+
+	if (ftruncate(fd, size)) {
+		perror("ftruncate");
+		exit(1);
+	}
+
+	r = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+	if (r == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	close(fd);
+
+	r->nr_channels = nr_channels;
+	r->nr_server_bells = nr_server_bells;
+	__atomic_store_n(&r->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+	return r;
+}
+
+struct shm_region *shm_region_attach(const char *name)
+{
+	struct shm_region *r;
+	struct stat st;
+	int fd;
+
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0) {
+		perror("shm_open");
+		exit(1);
+	}
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		exit(1);
+	}
+
+	r = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+	if (r == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	close(fd);
+
+	if (__atomic_load_n(&r->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+	    (size_t) st.st_size < shm_region_size(r->nr_channels)) {
+		fprintf(stderr, "shm: %s is not a spin region\n", name);
+		exit(1);
+	}
+
+	return r;
+}
+
+void shm_bell_wait(struct shm_doorbell *bell, uint32_t seq)
+{
+	syscall(SYS_futex, &bell->seq, FUTEX_WAIT, seq, NULL, NULL, 0);
+	__atomic_store_n(&bell->waiting, 0, __ATOMIC_RELAXED);
+}
+
+void shm_bell_wake(struct shm_doorbell *bell)
+{
+	__atomic_store_n(&bell->waiting, 0, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&bell->seq, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &bell->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* "name[:channels]" -> "/name", channel count defaults to 64 */
+const char *shm_parse_spec(char *spec, int *nr_channels)
+{
+	char *sep, *name;
+
+	*nr_channels = SHM_DEFAULT_CHANNELS;
+	sep = strchr(spec, ':');
+	if (sep) {
+		*sep = '\0';
+		*nr_channels = atoi(sep + 1);
+	}
+
+	if (spec[0] == '/')
+		return spec;
+
+	name = malloc(strlen(spec) + 2);
+	if (!name) {
+		perror("malloc");
+		exit(1);
+	}
+	name[0] = '/';
+	strcpy(name + 1, spec);
+	return name;
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Shared-memory transport for the spin protocol. A region in /dev/shm holds
+ * one channel per client connection; each channel is a pair of SPSC rings
+ * (requests and responses) of fixed-size messages. Consumers that run out
+ * of work may sleep on a futex doorbell, and producers only pay for a
+ * futex_wake() when somebody is actually sleeping.
+ *
+ * Request rings of channel i ring server doorbell (i % nr_server_bells);
+ * response rings ring the per-channel client doorbell.
+ */
+
+#define SHM_MAGIC		0x73706e72
+#define SHM_RING_SLOTS		64
+#define SHM_MSG_SIZE		56
+#define SHM_MAX_SERVER_BELLS	64
+
+struct shm_msg {
+	uint32_t len;
+	uint32_t pad;
+	unsigned char data[SHM_MSG_SIZE];
+};
+
+struct shm_ring {
+	uint32_t head __attribute__((aligned(64)));	/* consumer */
+	uint32_t tail __attribute__((aligned(64)));	/* producer */
+	struct shm_msg slots[SHM_RING_SLOTS] __attribute__((aligned(64)));
+};
+
+struct shm_doorbell {
+	uint32_t seq;
+	uint32_t waiting;
+} __attribute__((aligned(64)));
+
+struct shm_channel {
+	struct shm_ring req;
+	struct shm_ring resp;
+	struct shm_doorbell client_bell;
+};
+
+struct shm_region {
+	uint32_t magic;
+	uint32_t nr_channels;
+	uint32_t nr_server_bells;
+	struct shm_doorbell server_bells[SHM_MAX_SERVER_BELLS];
+	struct shm_channel channels[];
+};
+
+#if defined (__cplusplus)
+extern "C" {
+#endif
+
+struct shm_region *shm_region_create(const char *name, int nr_channels,
+				     int nr_server_bells);
+struct shm_region *shm_region_attach(const char *name);
+void shm_bell_wait(struct shm_doorbell *bell, uint32_t seq);
+void shm_bell_wake(struct shm_doorbell *bell);
+const char *shm_parse_spec(char *spec, int *nr_channels);
+
+#if defined (__cplusplus)
+}
+#endif
+
+static inline int shm_ring_push(struct shm_ring *ring, const void *buf,
+				uint32_t len)
+{
+	uint32_t tail = ring->tail;
+	struct shm_msg *msg;
+
+	if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == SHM_RING_SLOTS)
+		return 0;
+
+	msg = &ring->slots[tail % SHM_RING_SLOTS];
+	msg->len = len;
+	memcpy(msg->data, buf, len);
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * Copies at most @size bytes of the next message into @buf. Returns the
+ * message length, or 0 if the ring is empty.
+ */
+static inline uint32_t shm_ring_pop(struct shm_ring *ring, void *buf,
+				    uint32_t size)
+{
+	uint32_t head = ring->head;
+	struct shm_msg *msg;
+	uint32_t len;
+
+	if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	msg = &ring->slots[head % SHM_RING_SLOTS];
+	len = msg->len;
+	memcpy(buf, msg->data, len < size ? len : size);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return len;
+}
+
+static inline int shm_ring_empty(struct shm_ring *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+	       __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+static inline struct shm_doorbell *shm_server_bell(struct shm_region *r,
+						   int channel)
+{
+	return &r->server_bells[channel % r->nr_server_bells];
+}
+
+/*
+ * Sleeping: snapshot the sequence with shm_bell_prepare(), re-check the
+ * rings, then shm_bell_wait() with the snapshot. Waking: push, then
+ * shm_bell_ring(). The full barriers on both sides guarantee that either
+ * the consumer sees the message or the producer sees the sleeper.
+ */
+static inline uint32_t shm_bell_prepare(struct shm_doorbell *bell)
+{
+	uint32_t seq = __atomic_load_n(&bell->seq, __ATOMIC_ACQUIRE);
+
+	__atomic_store_n(&bell->waiting, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return seq;
+}
+
+static inline void shm_bell_cancel(struct shm_doorbell *bell)
+{
+	__atomic_store_n(&bell->waiting, 0, __ATOMIC_RELAXED);
+}
+
+static inline void shm_bell_ring(struct shm_doorbell *bell)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&bell->waiting, __ATOMIC_RELAXED))
+		shm_bell_wake(bell);
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "bufpool.h"
+#include "common.h"
+#include "request.h"
+#include "stats.h"
+
+/*
+ * Receive buffers and socket ops for the stream conns of spin-linux, also
+ * used by spin-bench so that it times the same code. Normally every conn
+ * owns a buffer for its whole life. With lazy_buffers a conn borrows its
+ * thread's scratch buffer while it runs and only keeps a buffer of its
+ * own while a partial request is pending.
+ */
+
+#define SOCK_BUF_SIZE 2048
+
+struct sock_buf {
+	unsigned char *buf;
+	int head;
+	int tail;
+};
+
+/* one per thread, like the buf_pool inside it */
+struct sock_buf_pool {
+	struct buf_pool bufs;
+	unsigned char scratch[SOCK_BUF_SIZE];
+};
+
+#define SOCK_BUF_POOL_INIT { { SOCK_BUF_SIZE, NULL } }
+
+static inline int sock_buf_avail(const struct sock_buf *sb)
+{
+	return sb->tail - sb->head;
+}
+
+static inline void sock_buf_init(struct sock_buf *sb, struct sock_buf_pool *pool)
+{
+	sb->head = 0;
+	sb->tail = 0;
+	sb->buf = NULL;
+	if (!lazy_buffers) {
+		stat_inc(STAT_BUF_ATTACHES);
+		sb->buf = buf_pool_get(&pool->bufs);
+	}
+}
+
+static inline void sock_buf_release(struct sock_buf *sb,
+				    struct sock_buf_pool *pool)
+{
+	if (sb->buf && sb->buf != pool->scratch) {
+		buf_pool_put(&pool->bufs, sb->buf);
+		stat_inc(STAT_BUF_RELEASES);
+	}
+	sb->buf = NULL;
+	sb->head = 0;
+	sb->tail = 0;
+}
+
+/* called once a lazy conn is done running, before anyone else may run it */
+static inline void sock_buf_settle(struct sock_buf *sb,
+				   struct sock_buf_pool *pool)
+{
+	int avail = sock_buf_avail(sb);
+
+	if (!avail) {
+		sock_buf_release(sb, pool);
+	} else if (sb->buf == pool->scratch) {
+		stat_inc(STAT_BUF_ATTACHES);
+		sb->buf = buf_pool_get(&pool->bufs);
+		memcpy(sb->buf, &pool->scratch[sb->head], avail);
+		sb->head = 0;
+		sb->tail = avail;
+	}
+}
+
+/* req_buf_recv() into the conn's buffer, reading at most @size at a time */
+static always_inline ssize_t sock_recv(int fd, struct sock_buf *sb,
+				       struct sock_buf_pool *pool, int size,
+				       void *dst, size_t len)
+{
+	if (!sb->buf)
+		sb->buf = pool->scratch;
+	return req_buf_recv(fd, sb->buf, size, &sb->head, &sb->tail, dst, len);
+}
+
+/* a reply that would block is resumed on the conn's next event */
+static always_inline ssize_t sock_send(int fd, const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	stat_inc(STAT_SYSCALLS);
+	ret = send(fd, buf, len, MSG_NOSIGNAL);
+	return ret < 0 ? -errno : ret;
+}
@@ -1,8 +1,12 @@
+#include <getopt.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "fake_worker.h"
+#include "alloc.h"
 #include "common.h"
+#include "core-policy.h"
+#include "shm-ring.h"
 
 FakeWorker *worker;
 
@@ -13,31 +17,197 @@ void do_work(int iterations)
 
 static void help(const char *prgname)
 {
-	printf("Usage: %s [--udp] service-time-distribution worker port arachne_args\n"
-	       "\n", prgname);
+	printf("Usage: %s arachne_args [options] worker port\n"
+	       "\n"
+	       "  --udp              serve UDP instead of TCP\n"
+	       "  --udp-batch N      serve UDP on the shared socket(s) with recvmmsg()\n"
+	       "                     and sendmmsg(), up to N datagrams per batch;\n"
+	       "                     --dispatchers shards over SO_REUSEPORT sockets\n"
+	       "  --shm NAME[:N]     serve N shared-memory channels instead of sockets\n"
+	       "                     (port is ignored)\n"
+	       "  --buffers MODE     eager (a receive buffer per conn) or lazy (only\n"
+	       "                     while a conn runs or has a partial request)\n"
+	       "  --dispatchers N    shard TCP connections over N dispatchers, each\n"
+	       "                     with its own listener and epoll set\n"
+	       "  --inline N|auto    serve requests of fewer than N iterations on the\n"
+	       "                     dispatcher; auto derives N from the measured\n"
+	       "                     thread spawn and per-iteration costs\n"
+	       "  --persistent       give each TCP conn a long-lived thread that the\n"
+	       "                     dispatcher wakes, instead of a new thread per\n"
+	       "                     burst of requests\n"
+	       "  --queue N          hold up to N readable conns or batches while no\n"
+	       "                     thread context is free (default 1024)\n"
+	       "  --overflow POLICY  when that queue is full: stop (stop reading),\n"
+	       "                     drop (close the conn or discard the datagrams)\n"
+	       "                     or reject (reply without doing the work)\n"
+	       "  --slo US[:P]       grow and shrink the core count so the P-th\n"
+	       "                     percentile (default 0.99) of queueing delay\n"
+	       "                     stays near US microseconds\n"
+	       "  --slo-interval MS  how often the core count is adjusted\n"
+	       "                     (default %d)\n"
+	       "  --slo-release F[:N]\n"
+	       "                     give a core back once that percentile has been\n"
+	       "                     below F (0 < F <= 1) times the target for N\n"
+	       "                     intervals (default %.1f:%d)\n"
+	       "  --cpu-stats        break CPU time down into work, user, kernel,\n"
+	       "                     spin and idle time every second\n"
+	       "  --split ITERS:K    run requests of at least ITERS iterations\n"
+	       "                     as K parallel parts (fork-join)\n"
+	       "  --block MODE       how blocking requests block their Arachne\n"
+	       "                     thread: sleep (the default) or backend (a call\n"
+	       "                     to a local mock backend)\n"
+	       "  --alloc STRATEGY[:NODES[:MIN-MAX]]\n"
+	       "                     build and free a graph of NODES objects of\n"
+	       "                     MIN-MAX bytes in every request, with malloc,\n"
+	       "                     arena (per-thread, reset per request) or pool\n"
+	       "                     (per-thread size classes); default %d:%d-%d\n",
+	       prgname, CORE_POLICY_INTERVAL_MS, CORE_POLICY_RELEASE,
+	       CORE_POLICY_CALM, ALLOC_DEFAULT_NODES, ALLOC_DEFAULT_MIN,
+	       ALLOC_DEFAULT_MAX);
 }
 
+static struct option long_options[] = {
+	{"udp", no_argument, NULL, 'u'},
+	{"udp-batch", required_argument, NULL, 'B'},
+	{"shm", required_argument, NULL, 's'},
+	{"split", required_argument, NULL, 'S'},
+	{"cpu-stats", no_argument, NULL, 'C'},
+	{"dispatchers", required_argument, NULL, 'd'},
+	{"persistent", no_argument, NULL, 'p'},
+	{"inline", required_argument, NULL, 'i'},
+	{"queue", required_argument, NULL, 'q'},
+	{"slo", required_argument, NULL, 'L'},
+	{"slo-interval", required_argument, NULL, 'I'},
+	{"slo-release", required_argument, NULL, 'R'},
+	{"overflow", required_argument, NULL, 'o'},
+	{"buffers", required_argument, NULL, 'b'},
+	{"block", required_argument, NULL, 'K'},
+	{"alloc", required_argument, NULL, 'A'},
+	{NULL, 0, NULL, 0},
+};
+
 int main(int argc, char *argv[])
 {
-	int udp, port, next_arg;
+	int udp = 0, port, opt;
 
 	init_arachne(&argc, (const char **)argv);
 
-        if (argc < 3) {
-                help(argv[0]);
-                return -1;
-        }
-
-        udp = !strcmp(argv[1], "--udp");
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'u':
+			udp = 1;
+			break;
+		case 'B':
+			udp = 1;
+			udp_batch = atoi(optarg);
+			break;
+		case 's':
+			shm_name = shm_parse_spec(optarg, &shm_channels);
+			break;
+		case 'b':
+			if (strcmp(optarg, "eager") && strcmp(optarg, "lazy")) {
+				fprintf(stderr, "unknown buffer mode %s\n", optarg);
+				return -1;
+			}
+			lazy_buffers = !strcmp(optarg, "lazy");
+			break;
+		case 'p':
+			persistent_threads = 1;
+			break;
+		case 'i':
+			if (!strcmp(optarg, "auto"))
+				inline_auto = 1;
+			else
+				inline_threshold = strtoull(optarg, NULL, 0);
+			break;
+		case 'L':
+			if (sscanf(optarg, "%lu:%lf", &core_policy.target_us,
+				   &core_policy.percentile) < 1 || !core_policy.target_us ||
+			    core_policy.percentile <= 0 || core_policy.percentile > 1) {
+				fprintf(stderr, "invalid SLO %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'I':
+			core_policy.interval_ms = atoi(optarg);
+			if (core_policy.interval_ms < 1) {
+				fprintf(stderr, "invalid interval %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'R':
+			if (sscanf(optarg, "%lf:%d", &core_policy.release,
+				   &core_policy.calm_intervals) < 1 ||
+			    core_policy.release <= 0 || core_policy.release > 1 ||
+			    core_policy.calm_intervals < 1) {
+				fprintf(stderr, "invalid release spec %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'q':
+			pending_limit = atoi(optarg);
+			if (pending_limit < 0) {
+				fprintf(stderr, "invalid queue size %s\n", optarg);
+				return -1;
+			}
+			admission_stats = 1;
+			break;
+		case 'o':
+			if (!strcmp(optarg, "stop")) {
+				overflow_policy = OVERFLOW_STOP;
+			} else if (!strcmp(optarg, "drop")) {
+				overflow_policy = OVERFLOW_DROP;
+			} else if (!strcmp(optarg, "reject")) {
+				overflow_policy = OVERFLOW_REJECT;
+			} else {
+				fprintf(stderr, "unknown overflow policy %s\n", optarg);
+				return -1;
+			}
+			admission_stats = 1;
+			break;
+		case 'd':
+			nr_dispatchers = atoi(optarg);
+			break;
+		case 'C':
+			cpu_stats = 1;
+			break;
+		case 'S':
+			if (sscanf(optarg, "%lu:%d", &split_threshold, &split_ways) != 2 ||
+			    split_ways < 1 || split_ways > MAX_SPLIT_WAYS) {
+				fprintf(stderr, "invalid split spec %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'K':
+			if (!strcmp(optarg, "sleep")) {
+				block_mode = BLOCK_SLEEP;
+			} else if (!strcmp(optarg, "backend")) {
+				block_mode = BLOCK_BACKEND;
+			} else {
+				fprintf(stderr, "unknown block mode %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'A':
+			if (alloc_parse(optarg)) {
+				fprintf(stderr, "invalid alloc spec %s\n", optarg);
+				return -1;
+			}
+			break;
+		default:
+			help(argv[0]);
+			return -1;
+		}
+	}
 
-        if (udp)
-		next_arg = 2;
-	else
-		next_arg = 1;
+	if (argc - optind < 2) {
+		help(argv[0]);
+		return -1;
+	}
 
-        worker = FakeWorkerFactory(argv[next_arg++]);
-        port = atoi(argv[next_arg++]);
-        start_arachne_server(udp, port);
+	worker = FakeWorkerFactory(argv[optind]);
+	port = atoi(argv[optind + 1]);
+	start_arachne_server(udp, port);
 
-        return 0;
+	return 0;
 }
@@ -0,0 +1,482 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "proto.h"
+#include "request.h"
+#include "sockbuf.h"
+#include "stats.h"
+
+/*
+ * Hot-path microbenchmark. Drives the request state machine the stream
+ * servers share (req_drive() in request.h) without a network or client:
+ * every round, each conn gets a burst of pipelined requests, written into
+ * a socketpair or served from memory by a fake fd, and only the server
+ * side is timed. Reports nanoseconds, instructions and syscalls per
+ * request for each fd, buffer and dispatch variant.
+ */
+
+#define MAX_CONNS 1024
+#define MAX_PIPELINE (SOCK_BUF_SIZE / sizeof(struct payload))
+
+enum fd_mode {
+	FD_MEM,		/* a fake fd that hands out the burst from memory */
+	FD_SOCKET,	/* one AF_UNIX socketpair per conn */
+};
+
+enum dispatch_mode {
+	DISPATCH_DIRECT,	/* serve every conn in turn */
+	DISPATCH_EPOLL,		/* level-triggered epoll, as spin-linux */
+	DISPATCH_ONESHOT,	/* EPOLLONESHOT, rearmed after every event */
+};
+
+struct variant {
+	const char *name;
+	enum fd_mode fd;
+	int lazy;
+	enum dispatch_mode dispatch;
+};
+
+static const struct variant variants[] = {
+	{"mem/eager/direct",	FD_MEM,		0, DISPATCH_DIRECT},
+	{"mem/lazy/direct",	FD_MEM,		1, DISPATCH_DIRECT},
+	{"socket/eager/direct",	FD_SOCKET,	0, DISPATCH_DIRECT},
+	{"socket/lazy/direct",	FD_SOCKET,	1, DISPATCH_DIRECT},
+	{"socket/eager/epoll",	FD_SOCKET,	0, DISPATCH_EPOLL},
+	{"socket/lazy/epoll",	FD_SOCKET,	1, DISPATCH_EPOLL},
+	{"socket/eager/oneshot", FD_SOCKET,	0, DISPATCH_ONESHOT},
+	{"socket/lazy/oneshot",	FD_SOCKET,	1, DISPATCH_ONESHOT},
+};
+
+struct conn {
+	int fd;			/* server end */
+	int peer;		/* client end */
+	struct req_state req;
+	struct sock_buf rx;
+
+	/* fake fd: bytes of the burst handed out, reply bytes swallowed */
+	int mem_head;
+	size_t mem_replied;
+};
+
+static struct conn conns[MAX_CONNS];
+static int nr_conns = 16;
+static int pipeline = 16;
+static uint64_t nr_requests = 1000000;
+static int timestamps;
+static int csv;
+static const char *only;
+
+static struct payload burst[MAX_PIPELINE];
+static size_t burst_size, reply_size;
+static uint64_t served;
+
+/* the receive buffers of common-linux.c; see sockbuf.h */
+int lazy_buffers;
+static struct sock_buf_pool rx_pool = SOCK_BUF_POOL_INIT;
+
+static ssize_t bench_recv(void *arg, void *buf, size_t len)
+{
+	struct conn *conn = arg;
+
+	return sock_recv(conn->fd, &conn->rx, &rx_pool, SOCK_BUF_SIZE, buf, len);
+}
+
+static ssize_t bench_send(void *arg, const void *buf, size_t len)
+{
+	struct conn *conn = arg;
+
+	return sock_send(conn->fd, buf, len);
+}
+
+/* like req_buf_recv(), with the rest of the burst standing in for recv() */
+static ssize_t mem_recv(void *arg, void *buf, size_t len)
+{
+	struct conn *conn = arg;
+	struct sock_buf *rx = &conn->rx;
+	int n;
+
+	if (!rx->buf)
+		rx->buf = rx_pool.scratch;
+	if (rx->head == rx->tail) {
+		n = burst_size - conn->mem_head;
+		if (!n)
+			return -EAGAIN;
+		memcpy(rx->buf, (char *) burst + conn->mem_head, n);
+		conn->mem_head += n;
+		rx->head = 0;
+		rx->tail = n;
+	}
+
+	if (len > (size_t) sock_buf_avail(rx))
+		len = sock_buf_avail(rx);
+	memcpy(buf, &rx->buf[rx->head], len);
+	rx->head += len;
+
+	return len;
+}
+
+static ssize_t mem_send(void *arg, const void *buf, size_t len)
+{
+	struct conn *conn = arg;
+
+	conn->mem_replied += len;
+	return len;
+}
+
+/* zero-work requests: only the per-request overhead is left */
+static void bench_work(void *arg, struct req_state *st)
+{
+	served++;
+}
+
+static const struct transport sock_transport = {
+	bench_recv, bench_send, bench_work, NULL, NULL,
+};
+static const struct transport mem_transport = {
+	mem_recv, mem_send, bench_work, NULL, NULL,
+};
+
+static always_inline void serve(struct conn *conn, const struct transport *t)
+{
+	if (req_drive(&conn->req, conn, t) == REQ_CLOSED) {
+		fprintf(stderr, "conn %d closed\n", (int) (conn - conns));
+		exit(1);
+	}
+	if (lazy_buffers)
+		sock_buf_settle(&conn->rx, &rx_pool);
+}
+
+static void conns_open(enum fd_mode mode)
+{
+	int i, sv[2];
+
+	for (i = 0; i < nr_conns; i++) {
+		memset(&conns[i], 0, sizeof(conns[i]));
+		req_init(&conns[i].req);
+		sock_buf_init(&conns[i].rx, &rx_pool);
+		conns[i].fd = conns[i].peer = -1;
+		if (mode == FD_MEM)
+			continue;
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+			perror("socketpair");
+			exit(1);
+		}
+		conns[i].fd = sv[0];
+		conns[i].peer = sv[1];
+		if (fcntl(sv[0], F_SETFL, O_NONBLOCK)) {
+			perror("fcntl");
+			exit(1);
+		}
+	}
+}
+
+static void conns_close(void)
+{
+	int i;
+
+	for (i = 0; i < nr_conns; i++) {
+		if (conns[i].fd >= 0) {
+			close(conns[i].fd);
+			close(conns[i].peer);
+		}
+		sock_buf_release(&conns[i].rx, &rx_pool);
+	}
+}
+
+static void epoll_add_all(int epfd, uint32_t events)
+{
+	struct epoll_event ev;
+	int i;
+
+	for (i = 0; i < nr_conns; i++) {
+		ev.events = events;
+		ev.data.ptr = &conns[i];
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &ev)) {
+			perror("epoll_ctl");
+			exit(1);
+		}
+	}
+}
+
+/* the client's half of a round, kept outside the measurement */
+static void round_fill(enum fd_mode mode)
+{
+	ssize_t ret;
+	size_t done;
+	int i;
+
+	for (i = 0; i < nr_conns; i++) {
+		if (mode == FD_MEM) {
+			conns[i].mem_head = 0;
+			continue;
+		}
+		for (done = 0; done < burst_size; done += ret) {
+			ret = send(conns[i].peer, (char *) burst + done,
+				   burst_size - done, 0);
+			if (ret <= 0) {
+				perror("send");
+				exit(1);
+			}
+		}
+	}
+}
+
+static void round_drain(enum fd_mode mode)
+{
+	char buf[MAX_PIPELINE * sizeof(struct payload_ts)];
+	size_t want = pipeline * reply_size, done;
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < nr_conns; i++) {
+		if (mode == FD_MEM) {
+			if (conns[i].mem_replied != want) {
+				fprintf(stderr, "conn %d: %zu reply bytes, expected %zu\n",
+					i, conns[i].mem_replied, want);
+				exit(1);
+			}
+			conns[i].mem_replied = 0;
+			continue;
+		}
+		for (done = 0; done < want; done += ret) {
+			ret = recv(conns[i].peer, buf, want - done, 0);
+			if (ret <= 0) {
+				perror("recv");
+				exit(1);
+			}
+		}
+	}
+}
+
+/* the server's half of a round: every request of the burst answered */
+static void round_serve(const struct variant *v, int epfd)
+{
+	struct epoll_event events[MAX_CONNS], ev;
+	uint64_t target = served + (uint64_t) nr_conns * pipeline;
+	struct conn *conn;
+	int i, n;
+
+	if (v->dispatch == DISPATCH_DIRECT) {
+		for (i = 0; i < nr_conns; i++) {
+			if (v->fd == FD_MEM)
+				serve(&conns[i], &mem_transport);
+			else
+				serve(&conns[i], &sock_transport);
+		}
+		return;
+	}
+
+	while (served < target) {
+		stat_inc(STAT_SYSCALLS);
+		n = epoll_wait(epfd, events, nr_conns, 0);
+		for (i = 0; i < n; i++) {
+			conn = events[i].data.ptr;
+			serve(conn, &sock_transport);
+			if (v->dispatch != DISPATCH_ONESHOT)
+				continue;
+			ev.events = EPOLLIN | EPOLLONESHOT;
+			ev.data.ptr = conn;
+			stat_inc(STAT_SYSCALLS);
+			epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+		}
+	}
+}
+
+/*
+ * Counts retired instructions of this thread, kernel included if
+ * perf_event_paranoid allows it. Returns -1 if there is no PMU.
+ */
+static int perf_open(int *user_only)
+{
+	struct perf_event_attr attr;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+	attr.disabled = 1;
+	attr.exclude_hv = 1;
+
+	*user_only = 0;
+	fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fd < 0) {
+		*user_only = 1;
+		attr.exclude_kernel = 1;
+		fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+
+	return fd;
+}
+
+static uint64_t perf_read(int fd)
+{
+	uint64_t count;
+
+	if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count))
+		return 0;
+	return count;
+}
+
+static void run_variant(const struct variant *v, int perf_fd)
+{
+	uint64_t rounds, r, start_tsc, cycles = 0, syscalls;
+	uint64_t nr = (uint64_t) nr_conns * pipeline;
+	double ns;
+	int epfd = -1;
+
+	lazy_buffers = v->lazy;
+	conns_open(v->fd);
+	if (v->dispatch != DISPATCH_DIRECT) {
+		epfd = epoll_create1(0);
+		epoll_add_all(epfd, EPOLLIN |
+			      (v->dispatch == DISPATCH_ONESHOT ? EPOLLONESHOT : 0));
+	}
+
+	/* one unmeasured round to fault in buffers and warm the caches */
+	round_fill(v->fd);
+	round_serve(v, epfd);
+	round_drain(v->fd);
+
+	rounds = (nr_requests + nr - 1) / nr;
+	if (perf_fd >= 0)
+		ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+	syscalls = 0;
+	for (r = 0; r < rounds; r++) {
+		round_fill(v->fd);
+		syscalls -= my_stats->v[STAT_SYSCALLS];
+		if (perf_fd >= 0)
+			ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+		start_tsc = rdtsc();
+		round_serve(v, epfd);
+		cycles += rdtsc() - start_tsc;
+		if (perf_fd >= 0)
+			ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+		syscalls += my_stats->v[STAT_SYSCALLS];
+		round_drain(v->fd);
+	}
+
+	ns = cycles / cycles_per_ns / (rounds * nr);
+	if (csv) {
+		printf("%s,%.1f,", v->name, ns);
+		if (perf_fd >= 0)
+			printf("%.1f", (double) perf_read(perf_fd) / (rounds * nr));
+		printf(",%.3f\n", (double) syscalls / (rounds * nr));
+	} else {
+		printf("%-22s %9.1f ", v->name, ns);
+		if (perf_fd >= 0)
+			printf("%10.1f ", (double) perf_read(perf_fd) / (rounds * nr));
+		else
+			printf("%10s ", "-");
+		printf("%13.3f\n", (double) syscalls / (rounds * nr));
+	}
+	fflush(stdout);
+
+	if (epfd >= 0)
+		close(epfd);
+	conns_close();
+}
+
+static void help(const char *prgname)
+{
+	printf("Usage: %s [options]\n"
+	       "\n"
+	       "  --requests N    requests per variant (default 1000000)\n"
+	       "  --conns N       connections served per round (default 16)\n"
+	       "  --pipeline N    requests each conn receives per round, in one\n"
+	       "                  burst (default 16, at most %zu)\n"
+	       "  --timestamps    request server-side timestamps\n"
+	       "  --only STR      only run variants whose name contains STR\n"
+	       "  --csv           print variant,ns/req,instr/req,syscalls/req\n",
+	       prgname, MAX_PIPELINE);
+}
+
+static struct option long_options[] = {
+	{"requests", required_argument, NULL, 'n'},
+	{"conns", required_argument, NULL, 'c'},
+	{"pipeline", required_argument, NULL, 'p'},
+	{"timestamps", no_argument, NULL, 'T'},
+	{"only", required_argument, NULL, 'o'},
+	{"csv", no_argument, NULL, 'C'},
+	{NULL, 0, NULL, 0},
+};
+
+int main(int argc, char *argv[])
+{
+	int opt, perf_fd, user_only;
+	size_t i;
+
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_requests = strtoull(optarg, NULL, 0);
+			break;
+		case 'c':
+			nr_conns = atoi(optarg);
+			break;
+		case 'p':
+			pipeline = atoi(optarg);
+			break;
+		case 'T':
+			timestamps = 1;
+			break;
+		case 'o':
+			only = optarg;
+			break;
+		case 'C':
+			csv = 1;
+			break;
+		default:
+			help(argv[0]);
+			return -1;
+		}
+	}
+
+	if (optind != argc || nr_conns < 1 || nr_conns > MAX_CONNS ||
+	    pipeline < 1 || pipeline > (int) MAX_PIPELINE || !nr_requests) {
+		help(argv[0]);
+		return -1;
+	}
+
+	tsc_calibrate();
+	my_stats = stats_register_thread();
+
+	for (i = 0; i < (size_t) pipeline; i++) {
+		burst[i].work_iterations = 0;
+		burst[i].index = htobe64(i);
+		if (timestamps)
+			proto_set_flags(&burst[i], PROTO_FLAG_TIMESTAMPS);
+	}
+	burst_size = pipeline * sizeof(struct payload);
+	reply_size = timestamps ? sizeof(struct payload_ts) : sizeof(struct payload);
+
+	perf_fd = perf_open(&user_only);
+	if (perf_fd < 0)
+		fprintf(stderr, "perf_event_open: %s, not counting instructions\n",
+			strerror(errno));
+
+	if (!csv)
+		printf("%d conns x %d pipelined requests per round, instructions: %s\n"
+		       "%-22s %9s %10s %13s\n",
+		       nr_conns, pipeline,
+		       perf_fd < 0 ? "n/a" : user_only ? "user" : "user+kernel",
+		       "variant", "ns/req", "instr/req", "syscalls/req");
+	for (i = 0; i < sizeof(variants) / sizeof(variants[0]); i++)
+		if (!only || strstr(variants[i].name, only))
+			run_variant(&variants[i], perf_fd);
+
+	return 0;
+}
@@ -0,0 +1,626 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <vector>
+
+#include "common.h"
+#include "proto.h"
+#include "shm-ring.h"
+
+/*
+ * Minimal closed-loop client for the spin protocol. Each client thread
+ * keeps one request outstanding, either on a long-lived connection, on a
+ * fresh connection per request (churn mode) or on its own channel of a
+ * server's shared-memory region.
+ */
+
+#define SHM_SPIN_ROUNDS 10000
+
+/* loopback idle conns per source address, well inside the port range */
+#define IDLE_PER_ADDR 25000
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+/* latency breakdown from server-side timestamps, in ns */
+enum breakdown {
+	BD_NETWORK,
+	BD_QUEUE,
+	BD_SERVICE,
+	BD_SERVER,
+	NR_BREAKDOWNS,
+};
+
+static const char *breakdown_names[NR_BREAKDOWNS] = {
+	"network",
+	"queueing",
+	"service",
+	"server",
+};
+
+struct client_thread {
+	pthread_t tid;
+	int id;
+	uint64_t requests;
+	uint64_t rejected;
+	unsigned int seed;
+	bool last_long;
+	bool last_block;
+	std::vector<uint64_t> latencies;
+	std::vector<uint64_t> long_latencies;
+	std::vector<uint64_t> block_latencies;
+	std::vector<uint64_t> breakdown[NR_BREAKDOWNS];
+};
+
+static struct sockaddr_in server_addr;
+static int nr_threads = 1;
+static int duration_s = 10;
+static uint64_t work_iterations;
+static uint64_t long_work;
+static double long_fraction;
+static uint32_t block_us;
+static double block_fraction;
+static int churn;
+static int csv;
+static int timestamps;
+static int idle_conns;
+static int udp;
+static struct shm_region *shm_region;
+static volatile int stop;
+
+static uint64_t htonll(uint64_t value)
+{
+	return __builtin_bswap64(value);
+}
+
+static int connect_server(void)
+{
+	int fd, one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *) &one, sizeof(one))) {
+		perror("setsockopt(TCP_NODELAY)");
+		exit(1);
+	}
+
+	if (connect(fd, (struct sockaddr *) &server_addr, sizeof(server_addr))) {
+		/* transient failures are expected under heavy churn */
+		if (errno == ECONNREFUSED) {
+			perror("connect");
+			exit(1);
+		}
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Opens idle_conns connections that never send anything. Against a
+ * loopback server they are spread over 127.0.0.2, 127.0.0.3, ... so that
+ * a million of them do not run out of ephemeral ports.
+ */
+static void open_idle_conns(void)
+{
+	struct sockaddr_in src;
+	struct rlimit rl;
+	uint64_t start = now_ns();
+	bool loopback = (ntohl(server_addr.sin_addr.s_addr) >> 24) == 127;
+	int i, fd, one = 1;
+
+	if (!getrlimit(RLIMIT_NOFILE, &rl)) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	memset(&src, 0, sizeof(src));
+	src.sin_family = AF_INET;
+
+	for (i = 0; i < idle_conns; i++) {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0) {
+			perror("socket");
+			exit(1);
+		}
+
+		if (loopback) {
+			/* pick the port at connect() time, per 4-tuple */
+			if (setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT,
+				       (void *) &one, sizeof(one))) {
+				perror("setsockopt(IP_BIND_ADDRESS_NO_PORT)");
+				exit(1);
+			}
+			src.sin_addr.s_addr = htonl(0x7f000002 + i / IDLE_PER_ADDR);
+			if (bind(fd, (struct sockaddr *) &src, sizeof(src))) {
+				perror("bind");
+				exit(1);
+			}
+		}
+
+		if (connect(fd, (struct sockaddr *) &server_addr, sizeof(server_addr))) {
+			fprintf(stderr, "idle connection %d: %s\n", i, strerror(errno));
+			exit(1);
+		}
+	}
+
+	if (!csv)
+		printf("opened %d idle connections in %.1f s\n", idle_conns,
+		       (now_ns() - start) / 1e9);
+}
+
+static int send_exactly(int fd, const void *buf, size_t size)
+{
+	const char *cbuf = (const char *) buf;
+	size_t partial = 0;
+	ssize_t ret;
+
+	while (partial < size) {
+		ret = send(fd, &cbuf[partial], size - partial, MSG_NOSIGNAL);
+		if (ret <= 0)
+			return -1;
+		partial += ret;
+	}
+
+	return 0;
+}
+
+static int recv_exactly(int fd, void *buf, size_t size)
+{
+	char *cbuf = (char *) buf;
+	size_t partial = 0;
+	ssize_t ret;
+
+	while (partial < size) {
+		ret = recv(fd, &cbuf[partial], size - partial, 0);
+		if (ret <= 0)
+			return -1;
+		partial += ret;
+	}
+
+	return 0;
+}
+
+static void shm_recv(struct shm_channel *ch, struct payload_ts *p)
+{
+	uint32_t seq;
+	int i;
+
+	for (i = 0; i < SHM_SPIN_ROUNDS; i++) {
+		if (shm_ring_pop(&ch->resp, p, sizeof(*p)))
+			return;
+		asm volatile("pause");
+	}
+
+	while (1) {
+		seq = shm_bell_prepare(&ch->client_bell);
+		if (shm_ring_pop(&ch->resp, p, sizeof(*p))) {
+			shm_bell_cancel(&ch->client_bell);
+			return;
+		}
+		shm_bell_wait(&ch->client_bell, seq);
+	}
+}
+
+/*
+ * Bimodal service times: a long_fraction of requests do long_work. A
+ * block_fraction of requests also block for block_us in the middle.
+ */
+static uint64_t next_work(struct client_thread *t)
+{
+	uint64_t work;
+
+	t->last_long = long_fraction > 0 &&
+		       rand_r(&t->seed) < long_fraction * RAND_MAX;
+	work = t->last_long ? long_work : work_iterations;
+	t->last_block = block_fraction > 0 &&
+			rand_r(&t->seed) < block_fraction * RAND_MAX;
+	if (t->last_block)
+		work = (uint64_t) block_us << 32 | (work & 0xffffffff);
+	return htonll(work);
+}
+
+static uint64_t make_index(struct client_thread *t)
+{
+	uint64_t index = ((uint64_t) t->id << 48) | t->requests;
+
+	if (timestamps)
+		index |= (uint64_t) PROTO_FLAG_TIMESTAMPS << 56;
+	if (t->last_block)
+		index |= (uint64_t) PROTO_FLAG_BLOCKING << 56;
+	return htonll(index);
+}
+
+static void record(struct client_thread *t, struct payload_ts *reply,
+		   uint64_t latency)
+{
+	uint64_t recv_ns, start_ns, end_ns, send_ns;
+
+	/* shed by an overloaded server: no work was done, so no latency */
+	if (proto_flags(&reply->payload) & PROTO_FLAG_REJECTED) {
+		t->rejected++;
+		return;
+	}
+
+	t->latencies.push_back(latency);
+	if (t->last_long)
+		t->long_latencies.push_back(latency);
+	if (t->last_block)
+		t->block_latencies.push_back(latency);
+	t->requests++;
+	if (!timestamps)
+		return;
+
+	recv_ns = be64toh(reply->recv_ns);
+	start_ns = be64toh(reply->start_ns);
+	end_ns = be64toh(reply->end_ns);
+	send_ns = be64toh(reply->send_ns);
+	t->breakdown[BD_SERVER].push_back(send_ns - recv_ns);
+	t->breakdown[BD_QUEUE].push_back(start_ns - recv_ns);
+	t->breakdown[BD_SERVICE].push_back(end_ns - start_ns);
+	t->breakdown[BD_NETWORK].push_back(send_ns - recv_ns < latency ?
+					   latency - (send_ns - recv_ns) : 0);
+}
+
+static void *shm_client_thread_main(void *arg)
+{
+	struct client_thread *t = (struct client_thread *) arg;
+	struct shm_channel *ch = &shm_region->channels[t->id];
+	struct payload_ts reply;
+	struct payload p;
+	uint64_t start;
+
+	while (!stop) {
+		start = now_ns();
+		p.work_iterations = next_work(t);
+		p.index = make_index(t);
+		while (!shm_ring_push(&ch->req, &p, sizeof(p)))
+			asm volatile("pause");
+		shm_bell_ring(shm_server_bell(shm_region, t->id));
+		shm_recv(ch, &reply);
+
+		record(t, &reply, now_ns() - start);
+	}
+
+	return NULL;
+}
+
+static void *client_thread_main(void *arg)
+{
+	struct client_thread *t = (struct client_thread *) arg;
+	size_t reply_len = timestamps ? sizeof(struct payload_ts) :
+					sizeof(struct payload);
+	struct payload_ts reply;
+	struct payload p;
+	uint64_t start;
+	int fd = -1;
+
+	while (!stop) {
+		start = now_ns();
+		if (fd < 0) {
+			fd = connect_server();
+			if (fd < 0)
+				continue;
+		}
+
+		p.work_iterations = next_work(t);
+		p.index = make_index(t);
+		if (send_exactly(fd, &p, sizeof(p)) ||
+		    recv_exactly(fd, &reply, reply_len)) {
+			close(fd);
+			fd = -1;
+			continue;
+		}
+
+		/* in churn mode this is connect-to-first-byte latency */
+		record(t, &reply, now_ns() - start);
+
+		if (churn) {
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	if (fd >= 0)
+		close(fd);
+
+	return NULL;
+}
+
+/*
+ * UDP: one connected socket per thread. A lost request or reply times out
+ * and is sent again; stale replies are recognised by their index.
+ */
+static void *udp_client_thread_main(void *arg)
+{
+	struct client_thread *t = (struct client_thread *) arg;
+	struct timeval timeout = { 0, 100000 };
+	struct payload_ts reply;
+	struct payload p;
+	uint64_t rejected = htonll((uint64_t) PROTO_FLAG_REJECTED << 56);
+	uint64_t start;
+	ssize_t ret;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		exit(1);
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))) {
+		perror("setsockopt(SO_RCVTIMEO)");
+		exit(1);
+	}
+	if (connect(fd, (struct sockaddr *) &server_addr, sizeof(server_addr))) {
+		perror("connect");
+		exit(1);
+	}
+
+	while (!stop) {
+		start = now_ns();
+		p.work_iterations = next_work(t);
+		p.index = make_index(t);
+		if (send(fd, &p, sizeof(p), 0) != sizeof(p))
+			continue;
+		do {
+			ret = recv(fd, &reply, sizeof(reply), 0);
+		} while (ret > 0 && (reply.payload.index & ~rejected) != p.index);
+		if (ret <= 0)
+			continue;
+
+		record(t, &reply, now_ns() - start);
+	}
+
+	close(fd);
+
+	return NULL;
+}
+
+static double percentile(const std::vector<uint64_t> &v, double p)
+{
+	if (v.empty())
+		return 0;
+	return v[std::min(v.size() - 1, (size_t) (v.size() * p))] / 1000.0;
+}
+
+static void report_breakdown(struct client_thread *threads)
+{
+	std::vector<uint64_t> all;
+	int i, j;
+
+	for (j = 0; j < NR_BREAKDOWNS; j++) {
+		all.clear();
+		for (i = 0; i < nr_threads; i++)
+			all.insert(all.end(), threads[i].breakdown[j].begin(),
+				   threads[i].breakdown[j].end());
+		std::sort(all.begin(), all.end());
+		printf("%s time (us): p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f\n",
+		       breakdown_names[j], percentile(all, 0.5),
+		       percentile(all, 0.9), percentile(all, 0.99),
+		       percentile(all, 0.999));
+	}
+}
+
+/* latency of one class of requests, such as the long ones */
+static void report_class(struct client_thread *threads, const char *name,
+			 std::vector<uint64_t> client_thread::*latencies)
+{
+	std::vector<uint64_t> all;
+	int i;
+
+	for (i = 0; i < nr_threads; i++)
+		all.insert(all.end(), (threads[i].*latencies).begin(),
+			   (threads[i].*latencies).end());
+	std::sort(all.begin(), all.end());
+	printf("%s request latency (us), %zu requests: p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+	       name, all.size(), percentile(all, 0.5), percentile(all, 0.9),
+	       percentile(all, 0.99), all.empty() ? 0 : all.back() / 1000.0);
+}
+
+static void report(struct client_thread *threads, double secs)
+{
+	std::vector<uint64_t> all;
+	uint64_t total = 0, rejected = 0;
+	int i;
+
+	for (i = 0; i < nr_threads; i++) {
+		total += threads[i].requests;
+		rejected += threads[i].rejected;
+		all.insert(all.end(), threads[i].latencies.begin(),
+			   threads[i].latencies.end());
+	}
+	std::sort(all.begin(), all.end());
+
+	if (csv) {
+		printf("%lu,%.2f,%.0f,%.1f,%.1f,%.1f,%.1f,%.1f\n", total, secs,
+		       total / secs, percentile(all, 0.5), percentile(all, 0.9),
+		       percentile(all, 0.99), percentile(all, 0.999),
+		       all.empty() ? 0 : all.back() / 1000.0);
+		return;
+	}
+
+	printf("requests %lu in %.2f s: %.0f req/s\n", total, secs, total / secs);
+	if (rejected)
+		printf("rejected %lu (%.1f%%)\n", rejected,
+		       100.0 * rejected / (total + rejected));
+	if (churn)
+		printf("connections/s %.0f\n", total / secs);
+	printf("%s latency (us): p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+	       churn ? "connect-to-first-byte" : "request",
+	       percentile(all, 0.5), percentile(all, 0.9),
+	       percentile(all, 0.99), percentile(all, 0.999),
+	       all.empty() ? 0 : all.back() / 1000.0);
+	if (long_fraction > 0)
+		report_class(threads, "long", &client_thread::long_latencies);
+	if (block_fraction > 0 && block_fraction < 1)
+		report_class(threads, "blocking", &client_thread::block_latencies);
+	if (timestamps)
+		report_breakdown(threads);
+}
+
+static void help(const char *prgname)
+{
+	printf("Usage: %s [options] host port\n"
+	       "       %s [options] --shm NAME\n"
+	       "\n"
+	       "  --threads N    concurrent closed-loop clients (default 1)\n"
+	       "  --duration S   run time in seconds (default 10)\n"
+	       "  --work N       work_iterations per request (default 0)\n"
+	       "  --long N:F     make a fraction F of requests do N iterations\n"
+	       "  --block US[:F] make a fraction F (default 1) of requests block\n"
+	       "                 for US microseconds halfway through their work;\n"
+	       "                 every server but spin-ix supports this\n"
+	       "  --idle N       hold N extra idle connections open during the run\n"
+	       "  --churn        open a new connection for every request\n"
+	       "  --udp          send requests as UDP datagrams\n"
+	       "  --csv          print requests,secs,rps,p50,p90,p99,p99.9,max\n"
+	       "  --shm NAME     use a server's shared-memory region, one channel\n"
+	       "                 per client thread\n"
+	       "  --timestamps   ask for server-side timestamps and break latency\n"
+	       "                 down into network, queueing and service time\n",
+	       prgname, prgname);
+}
+
+static struct option long_options[] = {
+	{"threads", required_argument, NULL, 't'},
+	{"duration", required_argument, NULL, 'd'},
+	{"work", required_argument, NULL, 'w'},
+	{"long", required_argument, NULL, 'l'},
+	{"block", required_argument, NULL, 'b'},
+	{"idle", required_argument, NULL, 'i'},
+	{"churn", no_argument, NULL, 'c'},
+	{"udp", no_argument, NULL, 'u'},
+	{"csv", no_argument, NULL, 'C'},
+	{"shm", required_argument, NULL, 's'},
+	{"timestamps", no_argument, NULL, 'T'},
+	{NULL, 0, NULL, 0},
+};
+
+int main(int argc, char *argv[])
+{
+	struct client_thread *threads;
+	struct hostent *he;
+	uint64_t start;
+	int i, opt;
+
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'd':
+			duration_s = atoi(optarg);
+			break;
+		case 'w':
+			work_iterations = strtoull(optarg, NULL, 0);
+			break;
+		case 'l':
+			if (sscanf(optarg, "%lu:%lf", &long_work, &long_fraction) != 2) {
+				help(argv[0]);
+				return -1;
+			}
+			break;
+		case 'b':
+			block_fraction = 1;
+			if (sscanf(optarg, "%u:%lf", &block_us, &block_fraction) < 1 ||
+			    block_fraction < 0 || block_fraction > 1) {
+				help(argv[0]);
+				return -1;
+			}
+			break;
+		case 'i':
+			idle_conns = atoi(optarg);
+			break;
+		case 'c':
+			churn = 1;
+			break;
+		case 'u':
+			udp = 1;
+			break;
+		case 'C':
+			csv = 1;
+			break;
+		case 's':
+			shm_region = shm_region_attach(shm_parse_spec(optarg, &i));
+			break;
+		case 'T':
+			timestamps = 1;
+			break;
+		default:
+			help(argv[0]);
+			return -1;
+		}
+	}
+
+	if (shm_region) {
+		if (nr_threads > (int) shm_region->nr_channels) {
+			fprintf(stderr, "region only has %u channels\n",
+				shm_region->nr_channels);
+			return 1;
+		}
+		churn = 0;
+		goto start;
+	}
+
+	if (argc - optind < 2 || nr_threads < 1) {
+		help(argv[0]);
+		return -1;
+	}
+
+	he = gethostbyname(argv[optind]);
+	if (!he) {
+		fprintf(stderr, "unknown host %s\n", argv[optind]);
+		return 1;
+	}
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	memcpy(&server_addr.sin_addr, he->h_addr_list[0], he->h_length);
+	server_addr.sin_port = htons(atoi(argv[optind + 1]));
+	if (idle_conns)
+		open_idle_conns();
+
+start:
+	threads = new client_thread[nr_threads];
+	start = now_ns();
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].id = i;
+		threads[i].requests = 0;
+		threads[i].rejected = 0;
+		threads[i].seed = i + 1;
+		threads[i].last_long = false;
+		threads[i].last_block = false;
+		if (pthread_create(&threads[i].tid, NULL, shm_region ?
+				   shm_client_thread_main : udp ?
+				   udp_client_thread_main : client_thread_main,
+				   &threads[i])) {
+			fprintf(stderr, "failed to spawn thread %d\n", i);
+			exit(-1);
+		}
+	}
+
+	sleep(duration_s);
+	stop = 1;
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i].tid, NULL);
+
+	report(threads, (now_ns() - start) / 1e9);
+	delete[] threads;
+
+	return 0;
+}
@@ -0,0 +1,64 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+
+#include "fake_worker.h"
+#include "common.h"
+
+FakeWorker *worker;
+
+void do_work(int iterations)
+{
+	worker->Work(iterations);
+}
+
+void init_thread(void)
+{
+}
+
+static void help(const char *prgname)
+{
+	printf("Usage: %s [options] worker n_cpu port\n"
+	       "\n"
+	       "  --no-steal         keep coroutines on the core that accepted them\n",
+	       prgname);
+}
+
+static struct option long_options[] = {
+	{"no-steal", no_argument, NULL, 'n'},
+	{NULL, 0, NULL, 0},
+};
+
+int main(int argc, char *argv[])
+{
+	int n_cpu, port, opt;
+
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			coro_steal = 0;
+			break;
+		default:
+			help(argv[0]);
+			return -1;
+		}
+	}
+
+	if (argc - optind < 3) {
+		help(argv[0]);
+		return -1;
+	}
+
+	worker = FakeWorkerFactory(argv[optind]);
+	if (!worker) {
+		std::cerr << "Invalid worker argument." << std::endl;
+		return 1;
+	}
+	n_cpu = atoi(argv[optind + 1]);
+	port = atoi(argv[optind + 2]);
+	init_coro(n_cpu, port);
+	start_coro_server();
+
+	return 0;
+}
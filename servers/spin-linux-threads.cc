@@ -0,0 +1,70 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+
+#include "fake_worker.h"
+#include "common.h"
+
+FakeWorker *worker;
+
+void do_work(int iterations)
+{
+	worker->Work(iterations);
+}
+
+void init_thread(void)
+{
+}
+
+static void help(const char *prgname)
+{
+	printf("Usage: %s [options] worker port\n"
+	       "\n"
+	       "  --pool N           serve connections from N pre-spawned threads\n"
+	       "                     instead of spawning one per connection\n"
+	       "  --stack-size KB    thread stack size (default: pthread default)\n",
+	       prgname);
+}
+
+static struct option long_options[] = {
+	{"pool", required_argument, NULL, 'p'},
+	{"stack-size", required_argument, NULL, 's'},
+	{NULL, 0, NULL, 0},
+};
+
+int main(int argc, char *argv[])
+{
+	int port, opt, pool = 0;
+	size_t stack_kb = 0;
+
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'p':
+			pool = atoi(optarg);
+			break;
+		case 's':
+			stack_kb = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			help(argv[0]);
+			return -1;
+		}
+	}
+
+	if (argc - optind < 2) {
+		help(argv[0]);
+		return -1;
+	}
+
+	worker = FakeWorkerFactory(argv[optind]);
+	if (!worker) {
+		std::cerr << "Invalid worker argument." << std::endl;
+		return 1;
+	}
+	port = atoi(argv[optind + 1]);
+	init_linux_threads(port, pool, stack_kb);
+	start_linux_threads_server();
+
+	return 0;
+}
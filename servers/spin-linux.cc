@@ -1,9 +1,12 @@
+#include <getopt.h>
 #include <stdio.h>
 #include <string.h>
 #include <iostream>
 
 #include "fake_worker.h"
+#include "alloc.h"
 #include "common.h"
+#include "shm-ring.h"
 
 FakeWorker *worker;
 
@@ -18,24 +21,137 @@ void init_thread(void)
 
 static void help(const char *prgname)
 {
-	printf("Usage: %s worker n_cpu port\n", prgname);
+	printf("Usage: %s [options] worker n_cpu port\n"
+	       "\n"
+	       "  --churn            tune the accept path for short-lived connections\n"
+	       "  --dispatch MODE    lock, exclusive, single, oneshot, balance or\n"
+	       "                     pipeline\n"
+	       "  --balance-interval MS\n"
+	       "                     how often balance mode samples thread load\n"
+	       "  --balance-threshold PCT\n"
+	       "                     load gap that triggers a migration\n"
+	       "  --stage-threads W:S\n"
+	       "                     fixed work and send pools for pipeline\n"
+	       "                     dispatch (default: adapt from 1 to n_cpu)\n"
+	       "  --buffers MODE     eager (a receive buffer per conn) or lazy (only\n"
+	       "                     while a partial request is pending); either\n"
+	       "                     one also turns on memory reporting\n"
+	       "  --cpu-stats        break CPU time down into work, user, kernel,\n"
+	       "                     spin and idle time every second\n"
+	       "  --split ITERS:K    run requests of at least ITERS iterations\n"
+	       "                     as K parallel parts (fork-join)\n"
+	       "  --block MODE       how blocking requests block the server thread:\n"
+	       "                     sleep (the default) or backend (a call to a\n"
+	       "                     local mock backend)\n"
+	       "  --alloc STRATEGY[:NODES[:MIN-MAX]]\n"
+	       "                     build and free a graph of NODES objects of\n"
+	       "                     MIN-MAX bytes in every request, with malloc,\n"
+	       "                     arena (per-thread, reset per request) or pool\n"
+	       "                     (per-thread size classes); default %d:%d-%d\n"
+	       "  --shm NAME[:N]     serve N shared-memory channels instead of TCP\n"
+	       "                     (port is ignored)\n",
+	       prgname, ALLOC_DEFAULT_NODES, ALLOC_DEFAULT_MIN, ALLOC_DEFAULT_MAX);
 }
 
+static struct option long_options[] = {
+	{"churn", no_argument, NULL, 'c'},
+	{"dispatch", required_argument, NULL, 'D'},
+	{"shm", required_argument, NULL, 's'},
+	{"split", required_argument, NULL, 'S'},
+	{"cpu-stats", no_argument, NULL, 'C'},
+	{"buffers", required_argument, NULL, 'b'},
+	{"balance-interval", required_argument, NULL, 'i'},
+	{"balance-threshold", required_argument, NULL, 't'},
+	{"stage-threads", required_argument, NULL, 'P'},
+	{"block", required_argument, NULL, 'K'},
+	{"alloc", required_argument, NULL, 'A'},
+	{NULL, 0, NULL, 0},
+};
+
 int main(int argc, char *argv[])
 {
-	int n_cpu, port;
-	if (argc < 3) {
+	int n_cpu, port, opt;
+
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'c':
+			churn_mode = 1;
+			break;
+		case 'D':
+			if (set_dispatch_mode(optarg)) {
+				fprintf(stderr, "unknown dispatch mode %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 's':
+			shm_name = shm_parse_spec(optarg, &shm_channels);
+			break;
+		case 'b':
+			if (strcmp(optarg, "eager") && strcmp(optarg, "lazy")) {
+				fprintf(stderr, "unknown buffer mode %s\n", optarg);
+				return -1;
+			}
+			lazy_buffers = !strcmp(optarg, "lazy");
+			memory_stats = 1;
+			break;
+		case 'C':
+			cpu_stats = 1;
+			break;
+		case 'S':
+			if (sscanf(optarg, "%lu:%d", &split_threshold, &split_ways) != 2 ||
+			    split_ways < 1 || split_ways > MAX_SPLIT_WAYS) {
+				fprintf(stderr, "invalid split spec %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'i':
+			balance_interval_ms = atoi(optarg);
+			break;
+		case 't':
+			balance_threshold = atoi(optarg);
+			break;
+		case 'P':
+			if (sscanf(optarg, "%d:%d", &pipeline_work_threads,
+				   &pipeline_send_threads) != 2 ||
+			    pipeline_work_threads < 1 || pipeline_send_threads < 1) {
+				fprintf(stderr, "invalid stage threads %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'K':
+			if (!strcmp(optarg, "sleep")) {
+				block_mode = BLOCK_SLEEP;
+			} else if (!strcmp(optarg, "backend")) {
+				block_mode = BLOCK_BACKEND;
+			} else {
+				fprintf(stderr, "unknown block mode %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'A':
+			if (alloc_parse(optarg)) {
+				fprintf(stderr, "invalid alloc spec %s\n", optarg);
+				return -1;
+			}
+			break;
+		default:
+			help(argv[0]);
+			return -1;
+		}
+	}
+
+	if (argc - optind < 3) {
 		help(argv[0]);
 		return -1;
 	}
 
-	worker = FakeWorkerFactory(argv[1]);
+	worker = FakeWorkerFactory(argv[optind]);
 	if (!worker) {
 		std::cerr << "Invalid worker argument." << std::endl;
 		return 1;
 	}
-	n_cpu = atoi(argv[2]);
-	port = atoi(argv[3]);
+	n_cpu = atoi(argv[optind + 1]);
+	port = atoi(argv[optind + 2]);
 	init_linux(n_cpu, port);
 	start_linux_server();
 
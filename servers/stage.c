@@ -0,0 +1,297 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "config.h"
+#include "stage.h"
+#include "stats.h"
+
+#define STAGE_SAMPLE_US 1000
+
+static struct stage *monitored[8];
+static int nr_monitored;
+static int monitor_adapts;
+
+static void *stage_alloc(size_t size)
+{
+	void *p;
+
+	if (posix_memalign(&p, 64, size)) {
+		perror("posix_memalign");
+		exit(1);
+	}
+	memset(p, 0, size);
+	return p;
+}
+
+/* @active consumers take new items from the start */
+void stage_init(struct stage *s, const char *name, void (*fn)(void *item),
+		int nr_threads, int nr_producers, int active)
+{
+	if (nr_threads < 1 || nr_threads > STAGE_MAX_THREADS ||
+	    nr_producers < 1 || nr_producers > STAGE_MAX_THREADS) {
+		fprintf(stderr, "invalid %s stage size %d\n", name, nr_threads);
+		exit(-1);
+	}
+
+	memset(s, 0, sizeof(*s));
+	s->name = name;
+	s->fn = fn;
+	s->nr_threads = nr_threads;
+	s->nr_producers = nr_producers;
+	s->active = active < 1 ? 1 : active > nr_threads ? nr_threads : active;
+	s->rings = stage_alloc(sizeof(*s->rings) * nr_threads * nr_producers);
+	s->outboxes = stage_alloc(sizeof(*s->outboxes) * nr_producers);
+	s->bells = stage_alloc(sizeof(*s->bells) * nr_threads);
+	s->threads = stage_alloc(sizeof(*s->threads) * nr_threads);
+}
+
+/*
+ * Hands the outbox to the active consumer this producer has queued the
+ * least for. If all of their rings are full, waits for one to drain.
+ */
+void stage_flush(struct stage *s)
+{
+	struct stage_outbox *out = &s->outboxes[thread_no];
+	struct stage_ring *ring;
+	uint32_t fill, best_fill, tail;
+	int i, c, best, active, done = 0;
+
+	while (done < out->n) {
+		active = s->active;
+		best = -1;
+		best_fill = STAGE_RING_SLOTS;
+		for (i = 0; i < active; i++) {
+			c = (out->next + i) % active;
+			ring = stage_ring(s, c, thread_no);
+			fill = ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+			if (fill < best_fill) {
+				best = c;
+				best_fill = fill;
+			}
+		}
+		out->next++;
+		if (best < 0) {
+			asm volatile("pause");
+			continue;
+		}
+
+		ring = stage_ring(s, best, thread_no);
+		tail = ring->tail;
+		while (done < out->n && best_fill++ < STAGE_RING_SLOTS)
+			ring->slots[tail++ % STAGE_RING_SLOTS] = out->items[done++];
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+		shm_bell_ring(&s->bells[best]);
+	}
+
+	out->n = 0;
+}
+
+/* takes up to a batch from consumer @id's rings, from @*from on */
+static int stage_pop(struct stage *s, int id, void **items, int *from)
+{
+	struct stage_ring *ring;
+	uint32_t head, tail;
+	int i, n = 0;
+
+	for (i = 0; i < s->nr_producers && n < STAGE_BATCH; i++) {
+		ring = stage_ring(s, id, (*from + i) % s->nr_producers);
+		head = ring->head;
+		tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			continue;
+		while (head != tail && n < STAGE_BATCH)
+			items[n++] = ring->slots[head++ % STAGE_RING_SLOTS];
+		__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+	}
+	*from = (*from + 1) % s->nr_producers;
+
+	return n;
+}
+
+static int stage_idle(struct stage *s, int id)
+{
+	struct stage_ring *ring;
+	int p;
+
+	for (p = 0; p < s->nr_producers; p++) {
+		ring = stage_ring(s, id, p);
+		if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) !=
+		    __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* like the shm server threads: spin for a while, then sleep on the bell */
+static void *stage_thread_main(void *arg)
+{
+	struct stage_thread *t = arg;
+	struct stage *s = t->stage;
+	struct shm_doorbell *bell = &s->bells[t->id];
+	void *items[STAGE_BATCH];
+	uint64_t start_tsc;
+	int i, n, idle = 0, from = 0;
+	uint32_t seq;
+
+	thread_no = t->id;
+	init_thread();
+
+	while (1) {
+		start_tsc = rdtsc();
+		n = stage_pop(s, t->id, items, &from);
+		if (n) {
+			for (i = 0; i < n; i++)
+				s->fn(items[i]);
+			if (s->next)
+				stage_flush(s->next);
+			t->busy_tsc += rdtsc() - start_tsc;
+			idle = 0;
+			continue;
+		}
+
+		stat_add(STAT_SPIN_CYCLES, rdtsc() - start_tsc);
+		if (++idle < STAGE_SPIN_ROUNDS) {
+			asm volatile("pause");
+			continue;
+		}
+
+		seq = shm_bell_prepare(bell);
+		if (stage_idle(s, t->id)) {
+			stat_inc(STAT_SYSCALLS);
+			shm_bell_wait(bell, seq);
+		} else {
+			shm_bell_cancel(bell);
+		}
+		idle = 0;
+	}
+
+	return NULL;
+}
+
+void stage_start(struct stage *s)
+{
+	pthread_t tid;
+	int i;
+
+	for (i = 0; i < s->nr_threads; i++) {
+		s->threads[i].stage = s;
+		s->threads[i].id = i;
+		if (pthread_create(&tid, NULL, stage_thread_main, &s->threads[i])) {
+			fprintf(stderr, "failed to spawn %s stage thread %d\n",
+				s->name, i);
+			exit(-1);
+		}
+		pthread_detach(tid);
+	}
+}
+
+/* items queued for any consumer, active or not */
+static uint64_t stage_backlog(struct stage *s)
+{
+	struct stage_ring *ring;
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < s->nr_threads * s->nr_producers; i++) {
+		ring = &s->rings[i];
+		sum += __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) -
+		       __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	}
+
+	return sum;
+}
+
+/*
+ * Grows a stage as soon as its consumers fall behind, but only shrinks it
+ * after CONFIG_PIPELINE_CALM intervals in which one thread fewer could
+ * have kept up, so that bursts do not make the pool flap.
+ */
+static void stage_adapt(struct stage *s, uint64_t interval_tsc)
+{
+	int active = s->active;
+	uint64_t busy = 0;
+	int i;
+
+	for (i = 0; i < s->nr_threads; i++)
+		busy += s->threads[i].busy_tsc;
+	s->load = (double) (busy - s->last_busy) / interval_tsc;
+	s->last_busy = busy;
+	s->backlog = s->samples ? (double) s->backlog_sum / s->samples / active : 0;
+	s->backlog_sum = 0;
+	s->samples = 0;
+
+	if (!monitor_adapts)
+		return;
+
+	if (s->backlog > CONFIG_PIPELINE_GROW && active < s->nr_threads) {
+		printf("pipeline: grow %s stage %d -> %d threads, backlog %.1f per thread\n",
+		       s->name, active, active + 1, s->backlog);
+		s->active = active + 1;
+		s->calm = 0;
+	} else if (active > 1 && s->backlog < 1 &&
+		   s->load < (active - 1) * CONFIG_PIPELINE_SHRINK_LOAD / 100.0) {
+		if (++s->calm < CONFIG_PIPELINE_CALM)
+			return;
+		printf("pipeline: shrink %s stage %d -> %d threads, load %.2f\n",
+		       s->name, active, active - 1, s->load);
+		s->active = active - 1;
+		s->calm = 0;
+	} else {
+		s->calm = 0;
+	}
+	fflush(stdout);
+}
+
+static void *stage_monitor_main(void *arg)
+{
+	uint64_t last = rdtsc(), now;
+	int i, ticks = 0;
+
+	while (1) {
+		usleep(STAGE_SAMPLE_US);
+		for (i = 0; i < nr_monitored; i++) {
+			monitored[i]->backlog_sum += stage_backlog(monitored[i]);
+			monitored[i]->samples++;
+		}
+		if (++ticks * STAGE_SAMPLE_US < CONFIG_PIPELINE_INTERVAL_MS * 1000)
+			continue;
+
+		now = rdtsc();
+		for (i = 0; i < nr_monitored; i++)
+			stage_adapt(monitored[i], now - last);
+		last = now;
+		ticks = 0;
+	}
+
+	return NULL;
+}
+
+/* samples @stages every millisecond; with @adapt also resizes them */
+void stage_monitor_start(struct stage **stages, int nr_stages, int adapt)
+{
+	pthread_t tid;
+
+	if (nr_stages > (int) (sizeof(monitored) / sizeof(monitored[0]))) {
+		fprintf(stderr, "too many stages\n");
+		exit(-1);
+	}
+	memcpy(monitored, stages, sizeof(*stages) * nr_stages);
+	nr_monitored = nr_stages;
+	monitor_adapts = adapt;
+
+	if (pthread_create(&tid, NULL, stage_monitor_main, NULL)) {
+		fprintf(stderr, "failed to spawn stage monitor\n");
+		exit(-1);
+	}
+}
+
+void stage_report(struct stage *s)
+{
+	printf(" %s=%d/%d backlog=%.1f load=%.2f", s->name, s->active,
+	       s->nr_threads, s->backlog, s->load);
+}
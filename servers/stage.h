@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "common.h"
+#include "shm-ring.h"
+
+/*
+ * SEDA-style stages for the pipeline dispatch mode of spin-linux. A stage
+ * is a pool of consumer threads. Each consumer is fed by one SPSC ring per
+ * producer thread, so a hand-off needs no lock and no atomic
+ * read-modify-write. Producers collect items in an outbox and publish a
+ * whole batch with one store, ringing the consumer's doorbell at most once.
+ *
+ * Producers only pick among the first `active` consumers. A monitor
+ * samples each stage's backlog and busy time and, unless the pools are
+ * fixed, resizes that window. Consumers outside it finish what they were
+ * given and then sleep.
+ */
+
+#define STAGE_MAX_THREADS 64
+#define STAGE_RING_SLOTS 256
+#define STAGE_BATCH 32
+#define STAGE_SPIN_ROUNDS 1000
+
+struct stage_ring {
+	uint32_t head __attribute__((aligned(64)));	/* consumer */
+	uint32_t tail __attribute__((aligned(64)));	/* producer */
+	void *slots[STAGE_RING_SLOTS];
+};
+
+struct stage_outbox {
+	int n;
+	unsigned int next;	/* where the search for a consumer starts */
+	void *items[STAGE_BATCH];
+} __attribute__((aligned(64)));
+
+struct stage_thread {
+	struct stage *stage;
+	int id;
+	volatile uint64_t busy_tsc;
+} __attribute__((aligned(64)));
+
+struct stage {
+	const char *name;
+	void (*fn)(void *item);	/* runs on a consumer, once per item */
+	struct stage *next;	/* flushed after every batch, if set */
+	int nr_threads;
+	int nr_producers;	/* producers index their outbox by thread_no */
+	volatile int active;
+	struct stage_ring *rings;	/* [consumer * nr_producers + producer] */
+	struct stage_outbox *outboxes;
+	struct shm_doorbell *bells;	/* one per consumer */
+	struct stage_thread *threads;
+
+	/* monitor state, and what it measured over the last interval */
+	uint64_t backlog_sum;
+	int samples;
+	int calm;
+	uint64_t last_busy;
+	double backlog;		/* mean queued items per active consumer */
+	double load;		/* busy consumers, on average */
+};
+
+#if defined (__cplusplus)
+extern "C" {
+#endif
+
+void stage_init(struct stage *s, const char *name, void (*fn)(void *item),
+		int nr_threads, int nr_producers, int active);
+void stage_start(struct stage *s);
+void stage_flush(struct stage *s);
+void stage_monitor_start(struct stage **stages, int nr_stages, int adapt);
+void stage_report(struct stage *s);
+
+#if defined (__cplusplus)
+}
+#endif
+
+static inline struct stage_ring *stage_ring(struct stage *s, int consumer,
+					    int producer)
+{
+	return &s->rings[consumer * s->nr_producers + producer];
+}
+
+/* buffered until the outbox is full or the caller flushes it */
+static inline void stage_push(struct stage *s, void *item)
+{
+	struct stage_outbox *out = &s->outboxes[thread_no];
+
+	out->items[out->n++] = item;
+	if (out->n == STAGE_BATCH)
+		stage_flush(s);
+}
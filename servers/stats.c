@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "stats.h"
+
+#define MAX_STAT_THREADS 65536
+
+static const char *stat_names[NR_STATS] = {
+	[STAT_ACCEPTS]		= "accepts",
+	[STAT_REQUESTS]		= "requests",
+	[STAT_CLOSES]		= "closes",
+	[STAT_STEALS]		= "steals",
+	[STAT_MIGRATIONS]	= "migrations",
+	[STAT_SPLITS]		= "splits",
+	[STAT_BUF_ATTACHES]	= "buf_attaches",
+	[STAT_BUF_RELEASES]	= "buf_releases",
+	[STAT_SPAWNS]		= "spawns",
+	[STAT_WAKEUPS]		= "wakeups",
+	[STAT_QUEUED]		= "queued",
+	[STAT_STALLS]		= "stalls",
+	[STAT_DROPS]		= "drops",
+	[STAT_REJECTS]		= "rejects",
+	[STAT_INLINE]		= "inline",
+	[STAT_BLOCKS]		= "blocks",
+	[STAT_ALLOCS]		= "allocs",
+	/* the CPU accounting counters have no rate of their own */
+};
+
+double cycles_per_ns = 1.0;
+
+static struct thread_stats stat_slots[MAX_STAT_THREADS];
+static int nr_stat_slots;
+static int free_slots[MAX_STAT_THREADS];
+static int nr_free_slots;
+static uint64_t retired[NR_STATS];
+static pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+static int stats_interval_ms;
+static void (*stats_reporter)(double secs);
+static int (*stats_nr_cores)(void);
+__thread struct thread_stats *my_stats;
+
+void tsc_calibrate(void)
+{
+	uint64_t start_ns, start_tsc;
+
+	start_ns = now_ns();
+	start_tsc = rdtsc();
+	usleep(10000);
+	cycles_per_ns = (double) (rdtsc() - start_tsc) / (now_ns() - start_ns);
+}
+
+struct thread_stats *stats_register_thread(void)
+{
+	int slot;
+
+	pthread_mutex_lock(&slot_lock);
+	if (nr_free_slots) {
+		slot = free_slots[--nr_free_slots];
+	} else if (nr_stat_slots < MAX_STAT_THREADS) {
+		slot = nr_stat_slots++;
+	} else {
+		fprintf(stderr, "stats: too many threads\n");
+		exit(1);
+	}
+	pthread_mutex_unlock(&slot_lock);
+
+	return &stat_slots[slot];
+}
+
+void stats_unregister_thread(void)
+{
+	int i;
+
+	if (!my_stats)
+		return;
+
+	pthread_mutex_lock(&slot_lock);
+	for (i = 0; i < NR_STATS; i++) {
+		retired[i] += my_stats->v[i];
+		my_stats->v[i] = 0;
+	}
+	free_slots[nr_free_slots++] = my_stats - stat_slots;
+	pthread_mutex_unlock(&slot_lock);
+
+	my_stats = NULL;
+}
+
+/* called once per interval after the counters are printed */
+void stats_set_reporter(void (*fn)(double secs))
+{
+	stats_reporter = fn;
+}
+
+/* virtual size and resident set of the whole process */
+void stats_mem_kb(long *vm_kb, long *rss_kb)
+{
+	long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+	long vm = 0, rss = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/statm", "r");
+	if (f) {
+		if (fscanf(f, "%ld %ld", &vm, &rss) != 2)
+			vm = rss = 0;
+		fclose(f);
+	}
+
+	*vm_kb = vm * page_kb;
+	*rss_kb = rss * page_kb;
+}
+
+static void stats_sum_all(uint64_t *sum)
+{
+	int i, j;
+
+	pthread_mutex_lock(&slot_lock);
+	memcpy(sum, retired, sizeof(retired));
+	for (i = 0; i < nr_stat_slots; i++)
+		for (j = 0; j < NR_STATS; j++)
+			sum[j] += *(volatile uint64_t *) &stat_slots[i].v[j];
+	pthread_mutex_unlock(&slot_lock);
+}
+
+static double tv_secs(struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/*
+ * Splits the capacity of the server's cores over the last interval into
+ * do_work time, other user time (parsing, dispatch, runtime overhead),
+ * kernel time (network stack and syscalls), application-level spinning and
+ * idle time. CPU time comes from getrusage() for the whole process.
+ */
+static void cpu_report(uint64_t *delta, struct rusage *usage,
+		       struct rusage *last_usage, double secs)
+{
+	double user, sys, work, spin, cpu, capacity;
+	uint64_t requests = delta[STAT_REQUESTS];
+	int cores = stats_nr_cores();
+
+	user = tv_secs(&usage->ru_utime) - tv_secs(&last_usage->ru_utime);
+	sys = tv_secs(&usage->ru_stime) - tv_secs(&last_usage->ru_stime);
+	work = delta[STAT_WORK_CYCLES] / cycles_per_ns / 1e9;
+	spin = delta[STAT_SPIN_CYCLES] / cycles_per_ns / 1e9;
+	cpu = user + sys;
+	capacity = cores * secs;
+
+	printf("cpu: cores=%d used=%.2f work=%.1f%% user=%.1f%% sys=%.1f%% "
+	       "spin=%.1f%% idle=%.1f%% efficiency=%.2f",
+	       cores, cpu / secs, 100 * work / capacity,
+	       100 * (user - work - spin) / capacity, 100 * sys / capacity,
+	       100 * spin / capacity, 100 * (capacity - cpu) / capacity,
+	       cpu > 0 ? work / cpu : 0);
+	if (requests)
+		printf(" cycles/req=%.0f syscalls/req=%.2f",
+		       cpu * 1e9 * cycles_per_ns / requests,
+		       (double) delta[STAT_SYSCALLS] / requests);
+	printf("\n");
+}
+
+static void *stats_thread_main(void *arg)
+{
+	uint64_t last[NR_STATS], cur[NR_STATS], delta[NR_STATS];
+	struct rusage usage, last_usage;
+	long last_us, cur_us;
+	double secs;
+	int i, printed;
+
+	stats_sum_all(last);
+	getrusage(RUSAGE_SELF, &last_usage);
+	last_us = mytime();
+
+	while (1) {
+		usleep(stats_interval_ms * 1000);
+		stats_sum_all(cur);
+		getrusage(RUSAGE_SELF, &usage);
+		cur_us = mytime();
+		secs = (cur_us - last_us) / 1e6;
+
+		printed = 0;
+		for (i = 0; i < NR_STATS; i++) {
+			delta[i] = cur[i] - last[i];
+			if (!delta[i] || !stat_names[i])
+				continue;
+			printf("%s%s/s=%.0f", printed ? " " : "stats: ",
+			       stat_names[i], delta[i] / secs);
+			printed = 1;
+		}
+		if (printed)
+			printf("\n");
+		if (stats_nr_cores)
+			cpu_report(delta, &usage, &last_usage, secs);
+		if (stats_reporter)
+			stats_reporter(secs);
+		fflush(stdout);
+
+		memcpy(last, cur, sizeof(last));
+		last_usage = usage;
+		last_us = cur_us;
+	}
+
+	return NULL;
+}
+
+uint64_t stats_sum(enum stat_id id)
+{
+	uint64_t sum[NR_STATS];
+
+	stats_sum_all(sum);
+	return sum[id];
+}
+
+/* @nr_cores: how many cores the server may currently use */
+void stats_cpu_accounting(int (*nr_cores)(void))
+{
+	stats_nr_cores = nr_cores;
+}
+
+void stats_start(int interval_ms)
+{
+	pthread_t tid;
+
+	stats_interval_ms = interval_ms;
+	if (pthread_create(&tid, NULL, stats_thread_main, NULL)) {
+		fprintf(stderr, "failed to spawn stats thread\n");
+		exit(-1);
+	}
+}
@@ -0,0 +1,327 @@
+// Benchmark harness shared by tbench_linux, tbench_coro and tbench_arachne.
+//
+// A benchmark is a function fn(rounds, samples) that performs @rounds
+// operations and may time each of them into samples[i], one histogram per
+// thread. Run() calls it for some warm-up trials, whose results are thrown
+// away, and then for the measured trials. Every trial gets an equal share
+// of the rounds.
+//
+// The reported mean ("took") is wall-clock time per operation, averaged
+// over the trials, with a 95% confidence interval from the spread between
+// trials. The percentiles come from the per-operation samples of all
+// trials, as seen by the thread that timed them, minus the cost of reading
+// the TSC. Both must measure the same operation: a ping-pong times each
+// half-trip, and a benchmark whose threads share the rounds says how many
+// operations each thread did with SetOperations(), so that the mean is per
+// operation per thread, like its samples.
+#pragma once
+
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+inline uint64_t Rdtsc() {
+  uint32_t lo, hi;
+  asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((uint64_t) hi << 32) | lo;
+}
+
+enum Format { kText, kCsv, kJson };
+
+struct Options {
+  int trials = 10;
+  int warmup = 1;
+  Format format = kText;
+  std::string filter;
+};
+
+namespace internal {
+
+inline Options &options() {
+  static Options o;
+  return o;
+}
+
+struct Clock {
+  double cycles_per_ns = 1;
+  uint64_t overhead = 0;  // cycles of an empty Rdtsc() pair
+  bool first = true;      // no result printed yet
+};
+
+inline Clock &clock() {
+  static Clock c;
+  return c;
+}
+
+}  // namespace internal
+
+// Log-linear histogram of cycle counts: exact below 64, then 32 buckets
+// per power of two, so each value is kept to within about 3%.
+class Histogram {
+ public:
+  static constexpr int kSubBits = 5;
+  static constexpr int kBuckets = (64 - kSubBits + 1) << kSubBits;
+
+  Histogram() : counts_(kBuckets) {}
+
+  void Add(uint64_t cycles) {
+    uint64_t overhead = internal::clock().overhead;
+
+    cycles = cycles > overhead ? cycles - overhead : 0;
+    counts_[Index(cycles)]++;
+    count_++;
+    if (cycles > max_)
+      max_ = cycles;
+  }
+
+  void Merge(const Histogram &other) {
+    for (int i = 0; i < kBuckets; ++i)
+      counts_[i] += other.counts_[i];
+    count_ += other.count_;
+    if (other.max_ > max_)
+      max_ = other.max_;
+  }
+
+  uint64_t Count() const { return count_; }
+  uint64_t Max() const { return max_; }
+
+  // the middle of the bucket holding the @p quantile, in cycles, but never
+  // more than the largest sample
+  double Percentile(double p) const {
+    uint64_t target = ceil(p * count_), seen = 0;
+    double mid;
+
+    if (!count_)
+      return 0;
+    for (int i = 0; i < kBuckets; ++i) {
+      seen += counts_[i];
+      if (seen >= target && counts_[i]) {
+        mid = Lower(i) + (Lower(i + 1) - Lower(i)) / 2.0;
+        return mid < max_ ? mid : max_;
+      }
+    }
+    return max_;
+  }
+
+ private:
+  static int Index(uint64_t v) {
+    int e;
+
+    if (v < (1 << (kSubBits + 1)))
+      return v;
+    e = 63 - __builtin_clzll(v);
+    return ((e - kSubBits) << kSubBits) + (v >> (e - kSubBits));
+  }
+
+  static uint64_t Lower(int i) {
+    int shift = (i >> kSubBits) - 1;
+
+    if (i < (1 << (kSubBits + 1)))
+      return i;
+    return (uint64_t) ((i & ((1 << kSubBits) - 1)) + (1 << kSubBits)) << shift;
+  }
+
+  std::vector<uint64_t> counts_;
+  uint64_t count_ = 0;
+  uint64_t max_ = 0;
+};
+
+// One histogram per thread, so that timing needs no synchronization.
+class Samples {
+ public:
+  // before the threads start
+  void Reserve(int nr_threads) {
+    if ((int) per_thread_.size() < nr_threads)
+      per_thread_.resize(nr_threads);
+  }
+
+  Histogram &operator[](int thread) { return per_thread_[thread]; }
+
+  // what the wall time of a trial is divided by; the rounds if unset
+  void SetOperations(uint64_t n) { operations_ = n; }
+  uint64_t Operations() const { return operations_; }
+
+  Histogram Merged() const {
+    Histogram all;
+
+    for (auto &h : per_thread_)
+      all.Merge(h);
+    return all;
+  }
+
+ private:
+  std::vector<Histogram> per_thread_ = std::vector<Histogram>(1);
+  uint64_t operations_ = 0;
+};
+
+// two-sided 95% quantiles of Student's t distribution, by degrees of freedom
+inline double TQuantile(int df) {
+  static const double t[] = {
+    0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+    2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093,
+    2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045,
+    2.042,
+  };
+
+  return df < (int) (sizeof(t) / sizeof(t[0])) ? t[df] : 1.96;
+}
+
+inline void Usage(const char *prgname) {
+  printf("Usage: %s [options]\n"
+         "\n"
+         "  --trials N       measured trials per benchmark (default 10)\n"
+         "  --warmup N       discarded trials before them (default 1)\n"
+         "  --format FORMAT  text, csv or json (default text)\n"
+         "  --filter STR     only run benchmarks whose name contains STR\n",
+         prgname);
+}
+
+// Parses the harness options and calibrates the TSC. Call it after the
+// runtime has taken its own options out of argv.
+inline void Init(int argc, char **argv) {
+  static struct option long_options[] = {
+    {"trials", required_argument, NULL, 't'},
+    {"warmup", required_argument, NULL, 'w'},
+    {"format", required_argument, NULL, 'f'},
+    {"filter", required_argument, NULL, 'F'},
+    {NULL, 0, NULL, 0},
+  };
+  Options &o = internal::options();
+  internal::Clock &c = internal::clock();
+  uint64_t start_tsc, min = UINT64_MAX, t;
+  int opt;
+
+  while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 't':
+      o.trials = atoi(optarg);
+      break;
+    case 'w':
+      o.warmup = atoi(optarg);
+      break;
+    case 'f':
+      if (!strcmp(optarg, "text")) {
+        o.format = kText;
+      } else if (!strcmp(optarg, "csv")) {
+        o.format = kCsv;
+      } else if (!strcmp(optarg, "json")) {
+        o.format = kJson;
+      } else {
+        fprintf(stderr, "unknown format %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'F':
+      o.filter = optarg;
+      break;
+    default:
+      Usage(argv[0]);
+      exit(1);
+    }
+  }
+  if (o.trials < 1 || o.warmup < 0) {
+    Usage(argv[0]);
+    exit(1);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  start_tsc = Rdtsc();
+  while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(50))
+    ;
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start);
+  c.cycles_per_ns = (double) (Rdtsc() - start_tsc) / ns.count();
+
+  for (int i = 0; i < 1000; ++i) {
+    t = Rdtsc();
+    t = Rdtsc() - t;
+    if (t < min)
+      min = t;
+  }
+  c.overhead = min;
+
+  if (o.format == kCsv)
+    printf("name,trials,rounds,mean_us,ci95_us,median_us,p99_us,p99_9_us,max_us\n");
+  else if (o.format == kJson)
+    printf("[");
+}
+
+// Runs @fn for the warm-up and measured trials and prints the result.
+template <typename F>
+void Run(const std::string &name, int rounds, F fn) {
+  const Options &o = internal::options();
+  internal::Clock &c = internal::clock();
+  int per_trial = rounds / o.trials > 0 ? rounds / o.trials : 1;
+  std::vector<double> means;
+  double mean = 0, var = 0, ci, us;
+  Histogram all;
+
+  if (!o.filter.empty() && name.find(o.filter) == std::string::npos)
+    return;
+
+  for (int i = 0; i < o.warmup; ++i) {
+    Samples samples;
+    fn(per_trial, samples);
+  }
+
+  for (int i = 0; i < o.trials; ++i) {
+    Samples samples;
+    auto start = std::chrono::steady_clock::now();
+    fn(per_trial, samples);
+    auto finish = std::chrono::steady_clock::now();
+    us = std::chrono::duration<double, std::micro>(finish - start).count();
+    means.push_back(us / (samples.Operations() ? samples.Operations() :
+                          per_trial));
+    all.Merge(samples.Merged());
+  }
+
+  for (double m : means)
+    mean += m / means.size();
+  for (double m : means)
+    var += (m - mean) * (m - mean);
+  ci = means.size() > 1 ?
+    TQuantile(means.size() - 1) * sqrt(var / (means.size() - 1)) /
+    sqrt(means.size()) : 0;
+
+  auto to_us = [&](double cycles){ return cycles / c.cycles_per_ns / 1000; };
+  double median = to_us(all.Percentile(0.5)), p99 = to_us(all.Percentile(0.99));
+  double p999 = to_us(all.Percentile(0.999)), max = to_us(all.Max());
+
+  switch (o.format) {
+  case kText:
+    printf("test '%s' took %g us. (95%% CI +-%.3g; median %.3g p99 %.3g "
+           "p99.9 %.3g max %.3g us)\n", name.c_str(), mean, ci, median, p99,
+           p999, max);
+    break;
+  case kCsv:
+    printf("%s,%d,%d,%g,%g,%g,%g,%g,%g\n", name.c_str(), o.trials, per_trial,
+           mean, ci, median, p99, p999, max);
+    break;
+  case kJson:
+    printf("%s\n  {\"name\": \"%s\", \"trials\": %d, \"rounds\": %d, "
+           "\"mean_us\": %g, \"ci95_us\": %g, \"median_us\": %g, "
+           "\"p99_us\": %g, \"p99_9_us\": %g, \"max_us\": %g}",
+           c.first ? "" : ",", name.c_str(), o.trials, per_trial, mean, ci,
+           median, p99, p999, max);
+    break;
+  }
+  c.first = false;
+  fflush(stdout);
+}
+
+inline void Finish() {
+  if (internal::options().format == kJson)
+    printf("\n]\n");
+  fflush(stdout);
+}
+
+}  // namespace bench
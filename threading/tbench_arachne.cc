@@ -1,42 +1,80 @@
-#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <thread>
+#include <vector>
 
 #include "Arachne/Arachne.h"
 
+#include "bench.h"
 
 namespace {
 
-using us = std::chrono::duration<double, std::micro>;
+using bench::Rdtsc;
 constexpr int kMeasureRounds = 1000000;
+constexpr int kScaleRounds = 100000;
+
+// Everything but the multi-core benchmarks runs on core 0.
+constexpr int kMainCore = 0;
+int nr_cores;
+
+// Runs fn(i) on n threads, thread i on core i, and joins them.
+template <typename F>
+void RunOnCores(int n, F fn) {
+  std::vector<Arachne::ThreadId> threads;
+
+  for (int i = 0; i < n; ++i) {
+    auto th = Arachne::createThreadOnCore(i, [&fn](int id){ fn(id); }, i);
+    if (th == Arachne::NullThread) {
+      std::cerr << "no thread context left on core " << i << std::endl;
+      exit(1);
+    }
+    threads.push_back(th);
+  }
+  for (auto th : threads)
+    Arachne::join(th);
+}
 
 void empty_thread() {;}
 
-void BenchSpawnJoin() {
-  for (int i = 0; i < kMeasureRounds; ++i) {
-    auto th = Arachne::createThread(empty_thread);
+void BenchSpawnJoin(int rounds, bench::Samples &s) {
+  for (int i = 0; i < rounds; ++i) {
+    uint64_t start = Rdtsc();
+    auto th = Arachne::createThreadOnCore(kMainCore, empty_thread);
     Arachne::join(th);
+    s[0].Add(Rdtsc() - start);
   }
 }
 
-void BenchUncontendedMutex() {
+void BenchUncontendedMutex(int rounds, bench::Samples &s) {
   Arachne::SpinLock mutex;
   volatile unsigned long foo = 0;
 
-  for (int i = 0; i < kMeasureRounds; ++i) {
+  for (int i = 0; i < rounds; ++i) {
+    uint64_t start = Rdtsc();
     mutex.lock();
     foo++;
     mutex.unlock();
+    s[0].Add(Rdtsc() - start);
   }
 }
 
-void yielder() {
-  for (int i = 0; i < kMeasureRounds / 2; ++i)
+// One sample per switch: from one thread's yield to the other's return.
+void yielder(int rounds, bench::Histogram *h, uint64_t *last) {
+  for (int i = 0; i < rounds / 2; ++i) {
+    *last = Rdtsc();
     Arachne::yield();
+    h->Add(Rdtsc() - *last);
+  }
 }
 
-void BenchYield() {
-  auto th = Arachne::createThread(yielder);
-  yielder();
+void BenchYield(int rounds, bench::Samples &s) {
+  uint64_t last = Rdtsc();
+
+  s.Reserve(2);
+  auto th = Arachne::createThreadOnCore(kMainCore, yielder, rounds, &s[1],
+                                        &last);
+  yielder(rounds, &s[0], &last);
   Arachne::join(th);
 }
 
@@ -44,83 +82,234 @@ struct pong {
   Arachne::SpinLock mutex;
   Arachne::ConditionVariable cv;
   bool dir = false;
+  uint64_t stamp = 0;
 };
 
-void ping_pong_1(struct pong *p)
+void ping_pong_1(struct pong *p, int rounds, bench::Histogram *h)
 {
   p->mutex.lock();
-  for (int i = 0; i < kMeasureRounds / 2; ++i) {
+  for (int i = 0; i < rounds / 2; ++i) {
     while (p->dir)
       p->cv.wait(p->mutex);
+    // the first turn was not woken by anyone
+    if (i)
+      h->Add(Rdtsc() - p->stamp);
+    p->stamp = Rdtsc();
     p->dir = true;
     p->cv.notifyOne();
   }
   p->mutex.unlock();
 }
 
-void BenchCondvarPingPong() {
+// One sample per half-trip: from one side's notify to the other's wakeup.
+void BenchCondvarPingPong(int rounds, bench::Samples &s) {
   struct pong p;
 
-  auto th = Arachne::createThread(ping_pong_1, &p);
+  s.Reserve(2);
+  auto th = Arachne::createThreadOnCore(kMainCore, ping_pong_1, &p, rounds,
+                                        &s[1]);
 
   p.mutex.lock();
-  for (int i = 0; i < kMeasureRounds / 2; ++i) {
+  for (int i = 0; i < rounds / 2; ++i) {
     while (!p.dir)
       p.cv.wait(p.mutex);
+    s[0].Add(Rdtsc() - p.stamp);
+    p.stamp = Rdtsc();
     p.dir = false;
     p.cv.notifyOne();
   }
+  p.mutex.unlock();
 
   Arachne::join(th);
 }
 
-void PrintResult(std::string name, us time) {
-  time /= kMeasureRounds;
-  std::cout << "test '" << name << "' took "<< time.count() << " us."
-            << std::endl;
+// Multi-core benchmarks, each with @n threads on @n cores.
+
+void BenchContendedMutex(int n, int rounds, bench::Samples &s) {
+  Arachne::SpinLock mutex;
+  volatile unsigned long foo = 0;
+
+  // each thread's own rate, like its samples
+  s.Reserve(n);
+  s.SetOperations(rounds / n);
+  RunOnCores(n, [&](int id){
+    for (int i = 0; i < rounds / n; ++i) {
+      uint64_t start = Rdtsc();
+      mutex.lock();
+      foo++;
+      mutex.unlock();
+      s[id].Add(Rdtsc() - start);
+    }
+  });
+}
+
+void BenchSpawnJoinFanout(int n, int rounds, bench::Samples &s) {
+  for (int i = 0; i < rounds; ++i) {
+    uint64_t start = Rdtsc();
+    RunOnCores(n, [](int id){;});
+    s[0].Add(Rdtsc() - start);
+  }
+}
+
+// Reusable barrier; the last thread to arrive wakes the others.
+class Barrier {
+ public:
+  explicit Barrier(int n) : n_(n) {}
+
+  void Wait() {
+    mutex_.lock();
+    unsigned long gen = gen_;
+
+    if (++count_ == n_) {
+      count_ = 0;
+      gen_++;
+      cv_.notifyAll();
+      mutex_.unlock();
+      return;
+    }
+    while (gen == gen_)
+      cv_.wait(mutex_);
+    mutex_.unlock();
+  }
+
+ private:
+  Arachne::SpinLock mutex_;
+  Arachne::ConditionVariable cv_;
+  int n_;
+  int count_ = 0;
+  unsigned long gen_ = 0;
+};
+
+void BenchBarrier(int n, int rounds, bench::Samples &s) {
+  Barrier b(n);
+
+  s.Reserve(n);
+  RunOnCores(n, [&](int id){
+    for (int i = 0; i < rounds; ++i) {
+      uint64_t start = Rdtsc();
+      b.Wait();
+      s[id].Add(Rdtsc() - start);
+    }
+  });
+}
+
+struct broadcast {
+  Arachne::SpinLock mutex;
+  Arachne::ConditionVariable cv;
+  Arachne::ConditionVariable done;
+  unsigned long gen = 0;
+  int acked = 0;
+};
+
+void notifier(struct broadcast *b, int n, int rounds, bench::Histogram *h)
+{
+  b->mutex.lock();
+  for (int i = 0; i < rounds; ++i) {
+    uint64_t start = Rdtsc();
+    b->acked = 0;
+    b->gen++;
+    b->cv.notifyAll();
+    while (b->acked < n)
+      b->done.wait(b->mutex);
+    h->Add(Rdtsc() - start);
+  }
+  b->mutex.unlock();
+}
+
+// One round: notifyAll() wakes @n waiters, and the last of them to see
+// the new generation tells the notifier.
+void BenchBroadcast(int n, int rounds, bench::Samples &s) {
+  struct broadcast b;
+
+  auto th = Arachne::createThreadOnCore(kMainCore, notifier, &b, n, rounds,
+                                        &s[0]);
+
+  RunOnCores(n, [&](int id){
+    b.mutex.lock();
+    for (unsigned long seen = 1; seen <= (unsigned long) rounds; ++seen) {
+      while (b.gen < seen)
+        b.cv.wait(b.mutex);
+      if (++b.acked == n)
+        b.done.notifyOne();
+    }
+    b.mutex.unlock();
+  });
+
+  Arachne::join(th);
+}
+
+// 1, 2, 4, ... cores, and then all of them
+std::vector<int> CoreCounts(int max) {
+  std::vector<int> counts;
+
+  for (int n = 1; n < max; n *= 2)
+    counts.push_back(n);
+  counts.push_back(max);
+  return counts;
+}
+
+template <typename F>
+void RunScaling(std::string name, int rounds, F fn) {
+  for (int n : CoreCounts(nr_cores)) {
+    bench::Run(name + "/" + std::to_string(n), rounds,
+      [&](int r, bench::Samples &s){ fn(n, r, s); });
+  }
 }
 
 int MainHandler() {
-  auto start = std::chrono::steady_clock::now();
-  BenchSpawnJoin();
-  auto finish = std::chrono::steady_clock::now();
-  PrintResult("SpawnJoin",
-	std::chrono::duration_cast<us>(finish - start));
-
-  start = std::chrono::steady_clock::now();
-  BenchUncontendedMutex();
-  finish = std::chrono::steady_clock::now();
-  PrintResult("UncontendedMutex",
-    std::chrono::duration_cast<us>(finish - start));
-
-  start = std::chrono::steady_clock::now();
-  BenchYield();
-  finish = std::chrono::steady_clock::now();
-  PrintResult("Yield",
-    std::chrono::duration_cast<us>(finish - start));
-
-  start = std::chrono::steady_clock::now();
-  BenchCondvarPingPong();
-  finish = std::chrono::steady_clock::now();
-  PrintResult("CondvarPingPong",
-    std::chrono::duration_cast<us>(finish - start));
+  bench::Run("SpawnJoin", kMeasureRounds, BenchSpawnJoin);
+  bench::Run("UncontendedMutex", kMeasureRounds, BenchUncontendedMutex);
+  bench::Run("Yield", kMeasureRounds, BenchYield);
+  bench::Run("CondvarPingPong", kMeasureRounds, BenchCondvarPingPong);
+
+  // per lock, per spawned group, per barrier and per wakeup round
+  RunScaling("ContendedMutex", kMeasureRounds, BenchContendedMutex);
+  RunScaling("SpawnJoinFanout", kScaleRounds, BenchSpawnJoinFanout);
+  RunScaling("Barrier", kScaleRounds, BenchBarrier);
+  RunScaling("Broadcast", kScaleRounds, BenchBroadcast);
+  bench::Finish();
 
   Arachne::shutDown();
   return 0;
 }
 
+// --maxNumCores from argv, or @def. Arachne::init() parses it too, but
+// minNumCores has to be set before that and must not exceed it.
+int MaxCoresArg(int argc, const char** argv, int def) {
+  const char *opt = "--maxNumCores";
+  size_t len = strlen(opt);
+
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], opt, len))
+      continue;
+    if (argv[i][len] == '=')
+      return atoi(argv[i] + len + 1);
+    if (!argv[i][len] && i + 1 < argc)
+      return atoi(argv[i + 1]);
+  }
+  return def;
+}
+
 } // anonymous namespace
 
 // Requires coreArbiter: ./coreArbiterServer
 int
 main(int argc, const char** argv) {
-    // Initialize the library
-    Arachne::minNumCores = 1;
-    Arachne::maxNumCores = 1;
+    // Initialize the library. The multi-core benchmarks sweep up to every
+    // core but the one the arbiter keeps; --maxNumCores overrides that,
+    // and keeps all of its cores unless --minNumCores is given as well.
+    nr_cores = std::thread::hardware_concurrency() - 1;
+    nr_cores = MaxCoresArg(argc, argv, nr_cores);
+    if (nr_cores < 1)
+        nr_cores = 1;
+    Arachne::minNumCores = nr_cores;
+    Arachne::maxNumCores = nr_cores;
     Arachne::disableLoadEstimation = true;
     Arachne::init(&argc, argv);
+    nr_cores = Arachne::maxNumCores;
+    bench::Init(argc, const_cast<char **>(argv));
 
-    Arachne::createThreadOnCore(2, MainHandler);
+    Arachne::createThreadOnCore(kMainCore, MainHandler);
 
     Arachne::waitForTermination();
     return 0;
@@ -0,0 +1,409 @@
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <utility>
+
+#include "bench.h"
+
+// A minimal single-core scheduler for stackless C++20 coroutines: one run
+// queue, no preemption and no reactor. Every switch is a coroutine resume
+// from Schedule()'s loop, or a symmetric transfer at the end of a task, so
+// the numbers show what the primitives themselves cost.
+
+namespace {
+
+using bench::Rdtsc;
+constexpr int kMeasureRounds = 1000000;
+
+std::deque<std::coroutine_handle<>> run_queue;
+
+void Ready(std::coroutine_handle<> h) {
+  run_queue.push_back(h);
+}
+
+// Resumes ready coroutines until there are none left.
+void Schedule() {
+  while (!run_queue.empty()) {
+    auto h = run_queue.front();
+    run_queue.pop_front();
+    h.resume();
+  }
+}
+
+// A coroutine that starts when spawned and can be joined once. The frame
+// lives until the Task goes away, so a joiner can tell it has finished.
+class Task {
+ public:
+  struct promise_type {
+    std::coroutine_handle<> joiner;
+    bool done = false;
+
+    struct FinalAwaiter {
+      bool await_ready() noexcept { return false; }
+      std::coroutine_handle<>
+      await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+        h.promise().done = true;
+        if (h.promise().joiner)
+          return h.promise().joiner;
+        return std::noop_coroutine();
+      }
+      void await_resume() noexcept {}
+    };
+
+    Task get_return_object() {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  explicit Task(std::coroutine_handle<promise_type> h) : h_(h) {}
+  Task(Task &&other) : h_(std::exchange(other.h_, nullptr)) {}
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+  ~Task() {
+    if (h_)
+      h_.destroy();
+  }
+
+  // puts the task on the run queue
+  Task &Spawn() {
+    Ready(h_);
+    return *this;
+  }
+
+  auto Join() {
+    struct Awaiter {
+      std::coroutine_handle<promise_type> h;
+
+      bool await_ready() { return h.promise().done; }
+      void await_suspend(std::coroutine_handle<> joiner) {
+        h.promise().joiner = joiner;
+      }
+      void await_resume() {}
+    };
+    return Awaiter{h_};
+  }
+
+ private:
+  std::coroutine_handle<promise_type> h_;
+};
+
+// co_await Yield() goes to the back of the run queue.
+struct Yield {
+  bool await_ready() { return false; }
+  void await_suspend(std::coroutine_handle<> h) { Ready(h); }
+  void await_resume() {}
+};
+
+// Unlock() hands the mutex straight to the first waiter, if there is one.
+class Mutex {
+ public:
+  auto Lock() {
+    struct Awaiter {
+      Mutex *m;
+
+      bool await_ready() {
+        if (m->locked_)
+          return false;
+        m->locked_ = true;
+        return true;
+      }
+      void await_suspend(std::coroutine_handle<> h) {
+        m->waiters_.push_back(h);
+      }
+      void await_resume() {}
+    };
+    return Awaiter{this};
+  }
+
+  void Unlock() {
+    if (waiters_.empty()) {
+      locked_ = false;
+      return;
+    }
+    Ready(waiters_.front());
+    waiters_.pop_front();
+  }
+
+ private:
+  friend class CondVar;
+
+  // resumes @h holding the mutex, as soon as it is free
+  void Acquire(std::coroutine_handle<> h) {
+    if (locked_) {
+      waiters_.push_back(h);
+      return;
+    }
+    locked_ = true;
+    Ready(h);
+  }
+
+  bool locked_ = false;
+  std::deque<std::coroutine_handle<>> waiters_;
+};
+
+// Notify moves a waiter onto the mutex's queue rather than waking it to
+// find the mutex held by the notifier.
+class CondVar {
+ public:
+  // co_await Wait(m) with @m held; it is held again on return
+  auto Wait(Mutex &m) {
+    struct Awaiter {
+      CondVar *cv;
+      Mutex *m;
+
+      bool await_ready() { return false; }
+      void await_suspend(std::coroutine_handle<> h) {
+        cv->waiters_.push_back(Waiter{h, m});
+        m->Unlock();
+      }
+      void await_resume() {}
+    };
+    return Awaiter{this, &m};
+  }
+
+  void NotifyOne() {
+    if (waiters_.empty())
+      return;
+    Waiter w = waiters_.front();
+    waiters_.pop_front();
+    w.m->Acquire(w.h);
+  }
+
+  void NotifyAll() {
+    while (!waiters_.empty())
+      NotifyOne();
+  }
+
+ private:
+  struct Waiter {
+    std::coroutine_handle<> h;
+    Mutex *m;
+  };
+
+  std::deque<Waiter> waiters_;
+};
+
+// An unbuffered channel, like make(chan T) in Go: Send() waits for a
+// receiver and Recv() for a sender, and the value is copied across directly.
+template <typename T>
+class Channel {
+ public:
+  auto Send(T value) {
+    struct Awaiter {
+      Channel *c;
+      T value;
+
+      bool await_ready() {
+        if (c->receivers_.empty())
+          return false;
+        Receiver r = c->receivers_.front();
+        c->receivers_.pop_front();
+        *r.slot = value;
+        Ready(r.h);
+        return true;
+      }
+      void await_suspend(std::coroutine_handle<> h) {
+        c->senders_.push_back(Sender{h, &value});
+      }
+      void await_resume() {}
+    };
+    return Awaiter{this, value};
+  }
+
+  auto Recv() {
+    struct Awaiter {
+      Channel *c;
+      T value;
+
+      bool await_ready() {
+        if (c->senders_.empty())
+          return false;
+        Sender s = c->senders_.front();
+        c->senders_.pop_front();
+        value = *s.value;
+        Ready(s.h);
+        return true;
+      }
+      void await_suspend(std::coroutine_handle<> h) {
+        c->receivers_.push_back(Receiver{h, &value});
+      }
+      T await_resume() { return value; }
+    };
+    return Awaiter{this, T()};
+  }
+
+ private:
+  struct Sender {
+    std::coroutine_handle<> h;
+    const T *value;
+  };
+  struct Receiver {
+    std::coroutine_handle<> h;
+    T *slot;
+  };
+
+  std::deque<Sender> senders_;
+  std::deque<Receiver> receivers_;
+};
+
+// Runs @root and everything it spawns to completion.
+void RunMain(Task root) {
+  root.Spawn();
+  Schedule();
+}
+
+Task Empty() {
+  co_return;
+}
+
+Task SpawnJoin(int rounds, bench::Samples &s) {
+  for (int i = 0; i < rounds; ++i) {
+    uint64_t start = Rdtsc();
+    Task t = Empty();
+    co_await t.Spawn().Join();
+    s[0].Add(Rdtsc() - start);
+  }
+}
+
+void BenchSpawnJoin(int rounds, bench::Samples &s) {
+  RunMain(SpawnJoin(rounds, s));
+}
+
+Task UncontendedMutex(int rounds, bench::Samples &s) {
+  Mutex m;
+  volatile unsigned long foo = 0;
+
+  for (int i = 0; i < rounds; ++i) {
+    uint64_t start = Rdtsc();
+    co_await m.Lock();
+    foo = foo + 1;
+    m.Unlock();
+    s[0].Add(Rdtsc() - start);
+  }
+}
+
+void BenchUncontendedMutex(int rounds, bench::Samples &s) {
+  RunMain(UncontendedMutex(rounds, s));
+}
+
+// One sample per switch: from one task's yield to the other's return.
+Task Yielder(int rounds, bench::Histogram *h, uint64_t *last) {
+  for (int i = 0; i < rounds / 2; ++i) {
+    *last = Rdtsc();
+    co_await Yield();
+    h->Add(Rdtsc() - *last);
+  }
+}
+
+Task YieldMain(int rounds, bench::Samples &s) {
+  uint64_t last = Rdtsc();
+  Task th = Yielder(rounds, &s[1], &last);
+
+  th.Spawn();
+  co_await Yielder(rounds, &s[0], &last).Spawn().Join();
+  co_await th.Join();
+}
+
+void BenchYield(int rounds, bench::Samples &s) {
+  s.Reserve(2);
+  RunMain(YieldMain(rounds, s));
+}
+
+struct Pong {
+  Mutex m;
+  CondVar cv;
+  bool dir = false;
+  uint64_t stamp = 0;
+};
+
+Task PingPong1(Pong *p, int rounds, bench::Histogram *h) {
+  co_await p->m.Lock();
+  for (int i = 0; i < rounds / 2; ++i) {
+    while (p->dir)
+      co_await p->cv.Wait(p->m);
+    // the first turn was not woken by anyone
+    if (i)
+      h->Add(Rdtsc() - p->stamp);
+    p->stamp = Rdtsc();
+    p->dir = true;
+    p->cv.NotifyOne();
+  }
+  p->m.Unlock();
+}
+
+// One sample per half-trip: from one side's notify to the other's wakeup.
+Task CondvarPingPong(int rounds, bench::Samples &s) {
+  Pong p;
+  Task th = PingPong1(&p, rounds, &s[1]);
+
+  th.Spawn();
+
+  co_await p.m.Lock();
+  for (int i = 0; i < rounds / 2; ++i) {
+    while (!p.dir)
+      co_await p.cv.Wait(p.m);
+    s[0].Add(Rdtsc() - p.stamp);
+    p.stamp = Rdtsc();
+    p.dir = false;
+    p.cv.NotifyOne();
+  }
+  p.m.Unlock();
+
+  co_await th.Join();
+}
+
+void BenchCondvarPingPong(int rounds, bench::Samples &s) {
+  s.Reserve(2);
+  RunMain(CondvarPingPong(rounds, s));
+}
+
+// Every message is the TSC at its send, so each side times one half-trip.
+Task Echo(Channel<uint64_t> *in, Channel<uint64_t> *out, int rounds,
+          bench::Histogram *h) {
+  for (int i = 0; i < rounds / 2; ++i) {
+    uint64_t sent = co_await in->Recv();
+    h->Add(Rdtsc() - sent);
+    co_await out->Send(Rdtsc());
+  }
+}
+
+// A value goes back and forth over a pair of channels.
+Task ChannelPingPong(int rounds, bench::Samples &s) {
+  Channel<uint64_t> ping, pong;
+  Task th = Echo(&ping, &pong, rounds, &s[1]);
+
+  th.Spawn();
+  for (int i = 0; i < rounds / 2; ++i) {
+    co_await ping.Send(Rdtsc());
+    uint64_t sent = co_await pong.Recv();
+    s[0].Add(Rdtsc() - sent);
+  }
+
+  co_await th.Join();
+}
+
+void BenchChannelPingPong(int rounds, bench::Samples &s) {
+  s.Reserve(2);
+  RunMain(ChannelPingPong(rounds, s));
+}
+
+void MainHandler() {
+  bench::Run("SpawnJoin", kMeasureRounds, BenchSpawnJoin);
+  bench::Run("UncontendedMutex", kMeasureRounds, BenchUncontendedMutex);
+  bench::Run("Yield", kMeasureRounds, BenchYield);
+  bench::Run("CondvarPingPong", kMeasureRounds, BenchCondvarPingPong);
+  bench::Run("ChannelPingPong", kMeasureRounds, BenchChannelPingPong);
+  bench::Finish();
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  bench::Init(argc, argv);
+  MainHandler();
+  return 0;
+}
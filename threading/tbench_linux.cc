@@ -1,104 +1,275 @@
-#include <chrono>
+#include <atomic>
 #include <iostream>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "bench.h"
 
 namespace {
 
-using us = std::chrono::duration<double, std::micro>;
+using bench::Rdtsc;
 constexpr int kMeasureRounds = 1000000;
+constexpr int kScaleRounds = 100000;
+
+// The CPUs we may run on. Thread i of a multi-core benchmark runs on
+// cpus[i]; everything else stays on cpus[0], like Arachne's core 0.
+std::vector<int> cpus;
+
+void PinSelf(int cpu) {
+  cpu_set_t set;
 
-void BenchSpawnJoin() {
-  for (int i = 0; i < kMeasureRounds; ++i) {
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// Runs fn(i) on n threads, thread i pinned to cpus[i], and joins them.
+template <typename F>
+void RunOnCores(int n, F fn) {
+  std::vector<std::thread> threads;
+
+  for (int i = 0; i < n; ++i) {
+    threads.emplace_back([&fn, i](){
+      PinSelf(cpus[i]);
+      fn(i);
+    });
+  }
+  for (auto &th : threads)
+    th.join();
+}
+
+void BenchSpawnJoin(int rounds, bench::Samples &s) {
+  for (int i = 0; i < rounds; ++i) {
+    uint64_t start = Rdtsc();
     auto th = std::thread([](){;});
     th.join();
+    s[0].Add(Rdtsc() - start);
   }
 }
 
-void BenchUncontendedMutex() {
+void BenchUncontendedMutex(int rounds, bench::Samples &s) {
   std::mutex m;
   volatile unsigned long foo = 0;
 
-  for (int i = 0; i < kMeasureRounds; ++i) {
-    std::unique_lock<std::mutex> l(m);
-    foo++;
+  for (int i = 0; i < rounds; ++i) {
+    uint64_t start = Rdtsc();
+    {
+      std::unique_lock<std::mutex> l(m);
+      foo++;
+    }
+    s[0].Add(Rdtsc() - start);
   }
 }
 
-void BenchYield() {
-  auto th = std::thread([](){
-    for (int i = 0; i < kMeasureRounds / 2; ++i)
+// One sample per switch: from one thread's yield to the other's return.
+void BenchYield(int rounds, bench::Samples &s) {
+  std::atomic<uint64_t> last(Rdtsc());
+
+  s.Reserve(2);
+  auto yielder = [&](int id){
+    for (int i = 0; i < rounds / 2; ++i) {
+      last.store(Rdtsc(), std::memory_order_relaxed);
       std::this_thread::yield();
-  });
+      s[id].Add(Rdtsc() - last.load(std::memory_order_relaxed));
+    }
+  };
+  auto th = std::thread(yielder, 1);
 
-  for (int i = 0; i < kMeasureRounds / 2; ++i)
-    std::this_thread::yield();
+  yielder(0);
 
   th.join();
 }
 
-void BenchCondvarPingPong() {
+// One sample per half-trip: from one side's notify to the other's wakeup.
+void BenchCondvarPingPong(int rounds, bench::Samples &s) {
   std::mutex m;
   std::condition_variable cv;
   bool dir = false; // shared and protected by @m.
+  uint64_t stamp = 0;
 
+  s.Reserve(2);
   auto th = std::thread([&](){
     std::unique_lock<std::mutex> l(m);
-    for (int i = 0; i < kMeasureRounds / 2; ++i) {
+    for (int i = 0; i < rounds / 2; ++i) {
       while (dir)
         cv.wait(l);
+      // the first turn was not woken by anyone
+      if (i)
+        s[1].Add(Rdtsc() - stamp);
+      stamp = Rdtsc();
       dir = true;
       cv.notify_one();
     }
   });
 
   std::unique_lock<std::mutex> l(m);
-  for (int i = 0; i < kMeasureRounds / 2; ++i) {
+  for (int i = 0; i < rounds / 2; ++i) {
     while (!dir)
       cv.wait(l);
+    s[0].Add(Rdtsc() - stamp);
+    stamp = Rdtsc();
     dir = false;
     cv.notify_one();
   }
+  l.unlock();
 
   th.join();
 }
 
-void PrintResult(std::string name, us time) {
-  time /= kMeasureRounds;
-  std::cout << "test '" << name << "' took "<< time.count() << " us."
-            << std::endl;
+// Multi-core benchmarks, each with @n threads on @n cores.
+
+void BenchContendedMutex(int n, int rounds, bench::Samples &s) {
+  std::mutex m;
+  volatile unsigned long foo = 0;
+
+  // each thread's own rate, like its samples
+  s.Reserve(n);
+  s.SetOperations(rounds / n);
+  RunOnCores(n, [&](int id){
+    for (int i = 0; i < rounds / n; ++i) {
+      uint64_t start = Rdtsc();
+      {
+        std::unique_lock<std::mutex> l(m);
+        foo++;
+      }
+      s[id].Add(Rdtsc() - start);
+    }
+  });
+}
+
+void BenchSpawnJoinFanout(int n, int rounds, bench::Samples &s) {
+  for (int i = 0; i < rounds; ++i) {
+    uint64_t start = Rdtsc();
+    RunOnCores(n, [](int id){;});
+    s[0].Add(Rdtsc() - start);
+  }
+}
+
+// Reusable barrier; the last thread to arrive wakes the others.
+class Barrier {
+ public:
+  explicit Barrier(int n) : n_(n) {}
+
+  void Wait() {
+    std::unique_lock<std::mutex> l(m_);
+    unsigned long gen = gen_;
+
+    if (++count_ == n_) {
+      count_ = 0;
+      gen_++;
+      cv_.notify_all();
+      return;
+    }
+    while (gen == gen_)
+      cv_.wait(l);
+  }
+
+ private:
+  std::mutex m_;
+  std::condition_variable cv_;
+  int n_;
+  int count_ = 0;
+  unsigned long gen_ = 0;
+};
+
+void BenchBarrier(int n, int rounds, bench::Samples &s) {
+  Barrier b(n);
+
+  s.Reserve(n);
+  RunOnCores(n, [&](int id){
+    for (int i = 0; i < rounds; ++i) {
+      uint64_t start = Rdtsc();
+      b.Wait();
+      s[id].Add(Rdtsc() - start);
+    }
+  });
+}
+
+// One round: notify_all() wakes @n waiters, and the last of them to see
+// the new generation tells the notifier.
+void BenchBroadcast(int n, int rounds, bench::Samples &s) {
+  std::mutex m;
+  std::condition_variable cv, done;
+  unsigned long gen = 0; // shared and protected by @m.
+  int acked = 0;
+
+  auto notifier = std::thread([&](){
+    std::unique_lock<std::mutex> l(m);
+    for (int i = 0; i < rounds; ++i) {
+      uint64_t start = Rdtsc();
+      acked = 0;
+      gen++;
+      cv.notify_all();
+      while (acked < n)
+        done.wait(l);
+      s[0].Add(Rdtsc() - start);
+    }
+  });
+
+  RunOnCores(n, [&](int id){
+    std::unique_lock<std::mutex> l(m);
+    for (unsigned long seen = 1; seen <= (unsigned long) rounds; ++seen) {
+      while (gen < seen)
+        cv.wait(l);
+      if (++acked == n)
+        done.notify_one();
+    }
+  });
+
+  notifier.join();
+}
+
+// 1, 2, 4, ... cores, and then all of them
+std::vector<int> CoreCounts(int max) {
+  std::vector<int> counts;
+
+  for (int n = 1; n < max; n *= 2)
+    counts.push_back(n);
+  counts.push_back(max);
+  return counts;
+}
+
+template <typename F>
+void RunScaling(std::string name, int rounds, F fn) {
+  for (int n : CoreCounts(cpus.size())) {
+    bench::Run(name + "/" + std::to_string(n), rounds,
+      [&](int r, bench::Samples &s){ fn(n, r, s); });
+  }
 }
 
 void MainHandler(void *arg) {
-  auto start = std::chrono::steady_clock::now();
-  BenchSpawnJoin();
-  auto finish = std::chrono::steady_clock::now();
-  PrintResult("SpawnJoin",
-	std::chrono::duration_cast<us>(finish - start));
-
-  start = std::chrono::steady_clock::now();
-  BenchUncontendedMutex();
-  finish = std::chrono::steady_clock::now();
-  PrintResult("UncontendedMutex",
-    std::chrono::duration_cast<us>(finish - start));
-
-  start = std::chrono::steady_clock::now();
-  BenchYield();
-  finish = std::chrono::steady_clock::now();
-  PrintResult("Yield",
-    std::chrono::duration_cast<us>(finish - start));
-
-  start = std::chrono::steady_clock::now();
-  BenchCondvarPingPong();
-  finish = std::chrono::steady_clock::now();
-  PrintResult("CondvarPingPong",
-    std::chrono::duration_cast<us>(finish - start));
+  bench::Run("SpawnJoin", kMeasureRounds, BenchSpawnJoin);
+  bench::Run("UncontendedMutex", kMeasureRounds, BenchUncontendedMutex);
+  bench::Run("Yield", kMeasureRounds, BenchYield);
+  bench::Run("CondvarPingPong", kMeasureRounds, BenchCondvarPingPong);
+
+  // per lock, per spawned group, per barrier and per wakeup round
+  RunScaling("ContendedMutex", kMeasureRounds, BenchContendedMutex);
+  RunScaling("SpawnJoinFanout", kScaleRounds, BenchSpawnJoinFanout);
+  RunScaling("Barrier", kScaleRounds, BenchBarrier);
+  RunScaling("Broadcast", kScaleRounds, BenchBroadcast);
+  bench::Finish();
 }
 
 } // anonymous namespace
 
 int main(int argc, char *argv[]) {
+  cpu_set_t set;
+
+  bench::Init(argc, argv);
+
+  sched_getaffinity(0, sizeof(set), &set);
+  for (int i = 0; i < CPU_SETSIZE; ++i) {
+    if (CPU_ISSET(i, &set))
+      cpus.push_back(i);
+  }
+  PinSelf(cpus[0]);
+
   MainHandler(NULL);
   return 0;
 }